@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <tr1/functional>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "structures.h"
+#include "networking.h"
+#include "packet_log.h"
+
+/*
+ * drives many client sessions against a server with the protocol code of the client, build with:
+ * g++ -std=c++11 -O2 -I"../Social-Network Client" -o load_gen load_gen.cpp "../Social-Network Client/networking.cpp" \
+ *     "../Social-Network Client/packet_log.cpp" -lpthread
+ * the users (user_prefix0 .. user_prefix<users - 1>) have to exist with the same password
+ */
+
+using namespace std;
+
+#define DEFAULT_SESSIONS 100
+#define DEFAULT_SECONDS 30
+#define SESSION_STACK (256 * 1024)	/* thousands of sessions, a thread each */
+#define POST_STAMP "loadgen t="	/* posts carry their send time, NOTIFY lag is measured against it */
+
+enum loadOps {
+	OP_LOGIN,
+	OP_POST,
+	OP_SHOW,
+	OP_LIST,
+	OP_COUNT
+};
+
+static const char *opNames[OP_COUNT] = { "LOGIN", "POST", "SHOW", "LIST" };
+
+/*
+ * session - a simulated user, run by its own thread
+ * sock_fd: its connection, -1 between connections (read by main to shut it down at the end)
+ * latency_us: per operation; LOGIN includes connecting, POST is the write only (the server answers a POST only
+ *             when it fails)
+ * notify_lag_us: from a post being written to a NOTIFY carrying it being read
+ */
+struct session {
+	int index;
+	string user;
+	atomic<int> sock_fd;
+	unsigned int sessionId;
+	unsigned int seed;
+	vector<uint32_t> latency_us[OP_COUNT];
+	unsigned long errors[OP_COUNT];
+	vector<uint32_t> notify_lag_us;
+};
+
+static string servername = "localhost";
+static int serverport = 5354;
+static string userPrefix = "user";
+static unsigned int userCount = 100;
+static string passwordHash;
+static unsigned int mix[OP_COUNT] = { 0, 5, 4, 1 };	/* weights of the operations */
+static unsigned int mixTotal;
+static unsigned int thinkMs = 0;
+static atomic<bool> running(true);
+static atomic<unsigned long> completed;
+
+static uint64_t nowUs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ * recordNotify() - the NOTIFY lag of every post from us in a notification (coalesced ones carry several)
+ */
+static void recordNotify(struct session *s, struct packet &pkt)
+{
+	uint64_t now = nowUs();
+	string &cnts = pkt.contents.rcvd_cnts;
+
+	for (size_t found = cnts.find(POST_STAMP); found != string::npos; found = cnts.find(POST_STAMP, found + 1))
+	{
+		uint64_t sent = strtoull(cnts.c_str() + found + strlen(POST_STAMP), NULL, 10);
+		if (sent > 0 && sent <= now)
+			s->notify_lag_us.push_back(now - sent);
+	}
+	return;
+}
+
+/*
+ * awaitResponse() - read until the response to a request, handling the notifications read meanwhile
+ * cmd: command of the request
+ * return 0(response in resp) -1(connection failed or closed)
+ */
+static int awaitResponse(struct session *s, enum commands cmd, struct packet &resp)
+{
+	while (1)
+	{
+		if (read_socket(s->sock_fd, resp) <= 0)
+			return -1;
+		if (resp.cmd_code == cmd)
+			return 0;
+		if (resp.cmd_code == NOTIFY)
+			recordNotify(s, resp);
+		else if (resp.cmd_code == POST) /* only a failed post is answered */
+			s->errors[OP_POST]++;
+	}
+}
+
+static int sendRequest(struct session *s, struct packet &req)
+{
+	req.sessionId = s->sessionId;
+	return write_socket(s->sock_fd, req);
+}
+
+/*
+ * login() - connect and log the user of a session in
+ * return 0(logged in) -1(failed, not connected)
+ */
+static int login(struct session *s)
+{
+	struct packet req, resp;
+	string &cnts = resp.contents.rcvd_cnts;
+	int sock_fd;
+
+	sock_fd = create_client_socket(servername, serverport);
+	if (sock_fd < 0)
+		return -1;
+	s->sock_fd = sock_fd;
+	s->sessionId = 0;
+	req.cmd_code = LOGIN;
+	req.contents.username = s->user;
+	req.contents.password = passwordHash;
+	req.contents.rcvd_cnts = wire_offer();
+	if (sendRequest(s, req) < 0 || awaitResponse(s, LOGIN, resp) < 0)
+		goto Failed;
+	/* accepted: nothing, or the wire capabilities (see isLoginAccepted of the client) */
+	if (cnts.length() && cnts.compare(0, strlen(WIRE_OFFER), WIRE_OFFER) != 0
+			&& cnts.compare(0, strlen(WIRE_ACCEPT), WIRE_ACCEPT) != 0)
+	{
+		if (s->errors[OP_LOGIN] == 0)
+			printf("Error (login): %s: %s\n", s->user.c_str(), cnts.c_str());
+		goto Failed;
+	}
+	s->sessionId = resp.sessionId;
+	wire_apply(sock_fd, cnts);
+	return 0;
+
+	Failed:
+	s->sock_fd = -1;
+	destroy_socket(sock_fd);
+	return -1;
+}
+
+/*
+ * logout() - log the user of a session out, the server closes the connection
+ */
+static void logout(struct session *s)
+{
+	struct packet req;
+	int sock_fd = s->sock_fd;
+
+	req.cmd_code = LOGOUT;
+	sendRequest(s, req);
+	s->sock_fd = -1;
+	destroy_socket(sock_fd);
+	return;
+}
+
+/*
+ * runOp() - run one operation of the mix
+ * return 0(done) -1(failed, the connection is closed)
+ */
+static int runOp(struct session *s, enum loadOps op)
+{
+	struct packet req, resp;
+	unsigned int other = rand_r(&s->seed) % userCount;
+	int ret = 0;
+
+	switch (op)
+	{
+	case OP_LOGIN: /* a new session of the same user */
+		logout(s);
+		return login(s);
+	case OP_POST:
+		req.cmd_code = POST;
+		req.contents.postee = userPrefix + to_string(other);
+		req.contents.post = POST_STAMP + to_string(nowUs());
+		return sendRequest(s, req) < 0 ? -1 : 0;
+	case OP_SHOW:
+		req.cmd_code = SHOW;
+		req.contents.wallOwner = userPrefix + to_string(other);
+		req.contents.rcvd_cnts = wall_page_request(0, WALL_PAGE_LIMIT);
+		ret = sendRequest(s, req);
+		break;
+	case OP_LIST:
+		req.cmd_code = LIST;
+		req.contents.rcvd_cnts = list_request("");
+		ret = sendRequest(s, req);
+		break;
+	default:
+		return -1;
+	}
+	if (ret < 0 || awaitResponse(s, req.cmd_code, resp) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * think() - wait between operations, reading the notifications that arrive meanwhile
+ */
+static void think(struct session *s)
+{
+	struct pollfd pfd;
+	struct packet pkt;
+	uint64_t until = nowUs() + thinkMs * 1000ULL, now;
+
+	while (running && (now = nowUs()) < until)
+	{
+		pfd.fd = s->sock_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (until - now + 999) / 1000) <= 0)
+			continue;
+		if (read_socket(s->sock_fd, pkt) <= 0)
+			return;
+		if (pkt.cmd_code == NOTIFY)
+			recordNotify(s, pkt);
+		else if (pkt.cmd_code == POST)
+			s->errors[OP_POST]++;
+	}
+	return;
+}
+
+/*
+ * runSession() - log in and run the mix until the end of the test
+ */
+static void runSession(struct session *s)
+{
+	uint64_t start;
+	unsigned int pick, op;
+
+	while (running)
+	{
+		start = nowUs();
+		if (login(s) < 0)
+		{
+			s->errors[OP_LOGIN]++;
+			sleep(1);
+			continue;
+		}
+		s->latency_us[OP_LOGIN].push_back(nowUs() - start);
+		completed++;
+		while (running)
+		{
+			pick = rand_r(&s->seed) % mixTotal;
+			for (op = 0; pick >= mix[op]; op++)
+				pick -= mix[op];
+			start = nowUs();
+			if (runOp(s, (enum loadOps) op) < 0)
+			{
+				if (running)
+					s->errors[op]++;
+				break;
+			}
+			s->latency_us[op].push_back(nowUs() - start);
+			completed++;
+			if (thinkMs > 0)
+				think(s);
+		}
+		if (s->sock_fd >= 0)
+		{
+			destroy_socket(s->sock_fd);
+			s->sock_fd = -1;
+		}
+	}
+	return;
+}
+
+/*
+ * printLatencies() - count, rate and nearest rank percentiles of latencies
+ */
+static void printLatencies(const char *name, vector<uint32_t> &latencies, unsigned long errors, double seconds)
+{
+	sort(latencies.begin(), latencies.end());
+	printf("%-7s %9zu ok %7lu failed %10.1f/s", name, latencies.size(), errors, latencies.size() / seconds);
+	if (!latencies.empty())
+	{
+		const double quantiles[] = { 50, 90, 99, 99.9 };
+		for (double q : quantiles)
+		{
+			size_t rank = (size_t) (q / 100 * latencies.size() + 0.999999);
+			printf("  p%g %8.3f", q, latencies[min(max(rank, (size_t) 1), latencies.size()) - 1] / 1000.0);
+		}
+		printf("  max %8.3f ms", latencies.back() / 1000.0);
+	}
+	printf("\n");
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	int sessionCount = DEFAULT_SESSIONS, seconds = DEFAULT_SECONDS, opt, i;
+	const char *usage = "Error: Usage is ./load_gen [-c sessions] [-d seconds] [-m login:post:show:list] [-z think_ms] "
+			"[-u user_prefix] [-U users] [-P password] [hostname] [port]\n";
+	std::tr1::hash<string> hashfun;
+	string password = "password";
+	struct session *sessions;
+	pthread_t *threads;
+	pthread_attr_t attr;
+
+	while ((opt = getopt(argc, argv, "c:d:m:z:u:U:P:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			sessionCount = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u:%u:%u:%u", &mix[OP_LOGIN], &mix[OP_POST], &mix[OP_SHOW], &mix[OP_LIST]) != 4)
+			{
+				printf("%s", usage);
+				return -1;
+			}
+			break;
+		case 'z':
+			thinkMs = atoi(optarg);
+			break;
+		case 'u':
+			userPrefix = optarg;
+			break;
+		case 'U':
+			userCount = atoi(optarg);
+			break;
+		case 'P':
+			password = optarg;
+			break;
+		default:
+			printf("%s", usage);
+			return -1;
+		}
+	}
+	switch (argc - optind)
+	{
+	case 0:
+			break;
+	case 1:
+			servername = argv[optind];
+			break;
+	case 2:
+			servername = argv[optind];
+			serverport = stoi(argv[optind + 1]);
+			break;
+	default:
+			printf("%s", usage);
+			return -1;
+	}
+	mixTotal = mix[OP_LOGIN] + mix[OP_POST] + mix[OP_SHOW] + mix[OP_LIST];
+	if (sessionCount <= 0 || seconds <= 0 || userCount == 0 || mixTotal == 0)
+	{
+		printf("%s", usage);
+		return -1;
+	}
+	passwordHash = to_string(hashfun(password)); /* as getLoginInfo of the client */
+	packet_log_config(PACKET_LOG_OFF, 1); /* the packet log would measure itself */
+
+	sessions = new struct session[sessionCount];
+	threads = new pthread_t[sessionCount];
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, SESSION_STACK);
+	for (i = 0; i < sessionCount; i++)
+	{
+		sessions[i].index = i;
+		sessions[i].user = userPrefix + to_string(i % userCount);
+		sessions[i].sock_fd = -1;
+		sessions[i].seed = i + 1;
+		memset(sessions[i].errors, 0, sizeof(sessions[i].errors));
+		if (pthread_create(&threads[i], &attr, (void * (*) (void *)) runSession, (void *) &sessions[i]) != 0)
+		{
+			printf("Error (pthread_create): session %d\n", i);
+			return -1;
+		}
+	}
+
+	uint64_t started = nowUs();
+	unsigned long last = 0;
+	for (i = 1; i <= seconds; i++)
+	{
+		sleep(1);
+		unsigned long done = completed;
+		printf("%3d s: %8lu ops/s\n", i, done - last);
+		last = done;
+	}
+	running = false;
+	double elapsed = (nowUs() - started) / 1e6;
+	/* wake the sessions blocked in a read */
+	for (i = 0; i < sessionCount; i++)
+	{
+		int sock_fd = sessions[i].sock_fd;
+		if (sock_fd >= 0)
+			shutdown(sock_fd, SHUT_RDWR);
+	}
+	for (i = 0; i < sessionCount; i++)
+		pthread_join(threads[i], NULL);
+
+	vector<uint32_t> latencies[OP_COUNT], lags;
+	unsigned long errors[OP_COUNT] = { 0 };
+	for (i = 0; i < sessionCount; i++)
+	{
+		for (int op = 0; op < OP_COUNT; op++)
+		{
+			latencies[op].insert(latencies[op].end(), sessions[i].latency_us[op].begin(), sessions[i].latency_us[op].end());
+			errors[op] += sessions[i].errors[op];
+		}
+		lags.insert(lags.end(), sessions[i].notify_lag_us.begin(), sessions[i].notify_lag_us.end());
+	}
+	printf("%d sessions for %.1f s, %lu operations (%.1f/s)\n", sessionCount, elapsed, completed.load(),
+			completed / elapsed);
+	for (int op = 0; op < OP_COUNT; op++)
+		printLatencies(opNames[op], latencies[op], errors[op], elapsed);
+	printLatencies("NOTIFY", lags, 0, elapsed);
+	return 0;
+}
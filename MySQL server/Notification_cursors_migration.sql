@@ -0,0 +1,18 @@
+/*moves an existing database from one Notifications row per user per post to NotificationCursors*/
+CREATE TABLE `SocialNetwork`.`NotificationCursors` (
+  `userID` smallint(5) unsigned NOT NULL,
+  `lastPostID` smallint(5) unsigned NOT NULL DEFAULT 0,
+  PRIMARY KEY (`userID`),
+  CONSTRAINT `fk_NotificationCursors_1` FOREIGN KEY (`userID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+/*the cursor stops before the oldest unread notification of a user, users with none are up to date*/
+insert into SocialNetwork.NotificationCursors (userID, lastPostID)
+select Users.userID,
+	coalesce((select min(postID) - 1 from SocialNetwork.Notifications
+			where Notifications.userID = Users.userID and readFlag = 0),
+		(select coalesce(max(postID), 0) from SocialNetwork.Posts))
+from SocialNetwork.Users;
+
+/*once the server using the cursors is running*/
+DROP TABLE `SocialNetwork`.`Notifications`;
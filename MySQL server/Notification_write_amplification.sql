@@ -0,0 +1,155 @@
+/*write amplification of notifications, per-user Notifications rows against NotificationCursors.
+runs in its own database, SocialNetworkBench, with the seeded users of Query_scratchpad.sql, on an otherwise
+idle server since the row counters are server wide:
+	mysql -u root -p < "Notification_write_amplification.sql"
+@online: users logged in and receiving every post (at most the 20 seeded users)
+@posts: posts made
+@posts_per_round: posts a dispatcher round delivers together, the cursors advance once per round
+rowsWritten is the Innodb_rows_inserted + Innodb_rows_updated delta, statements the DML statements run;
+the per post columns are the cost of one post*/
+set @online = 20;
+set @posts = 200;
+set @posts_per_round = 1;
+
+DROP DATABASE IF EXISTS `SocialNetworkBench`;
+CREATE DATABASE `SocialNetworkBench` /*!40100 DEFAULT CHARACTER SET latin1 */;
+USE `SocialNetworkBench`;
+
+CREATE TABLE `Users` (
+  `userID` smallint(5) unsigned NOT NULL AUTO_INCREMENT,
+  `userName` varchar(25) NOT NULL,
+  `passwordHash` varchar(25) NOT NULL,
+  PRIMARY KEY (`userID`),
+  UNIQUE KEY `userName_UNIQUE` (`userName`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+CREATE TABLE `Posts` (
+  `postID` smallint(5) unsigned NOT NULL AUTO_INCREMENT,
+  `posterUserID` smallint(5) unsigned NOT NULL,
+  `posteeUserID` smallint(5) unsigned NOT NULL,
+  `timestamp` datetime(6) NOT NULL DEFAULT NOW(6),
+  `content` TEXT NOT NULL,
+  PRIMARY KEY (`postID`),
+  KEY `fk_Posts_1_idx` (`posterUserID`),
+  CONSTRAINT `fk_Posts_1` FOREIGN KEY (`posterUserID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE,
+  KEY `fk_Posts_2_idx` (`posteeUserID`),
+  CONSTRAINT `fk_Posts_2` FOREIGN KEY (`posteeUserID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+/*before: one row per user per post, marked read one at a time*/
+CREATE TABLE `Notifications` (
+  `notificationID` smallint(5) unsigned NOT NULL AUTO_INCREMENT,
+  `postID` smallint(5) unsigned NOT NULL,
+  `userID` smallint(5) unsigned NOT NULL,
+  `readFlag` boolean NOT NULL DEFAULT 0,
+  `timestamp` datetime(6) NOT NULL DEFAULT NOW(6),
+  PRIMARY KEY (`notificationID`),
+  UNIQUE KEY `post_user_UNIQUE` (`postID`,`userID`),
+  KEY `fk_Notifications_1_idx` (`userID`),
+  CONSTRAINT `fk_Notifications_1` FOREIGN KEY (`userID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE,
+  KEY `fk_Notifications_2_idx` (`postID`),
+  CONSTRAINT `fk_Notifications_2` FOREIGN KEY (`postID`) REFERENCES `Posts` (`postID`) ON DELETE CASCADE ON UPDATE CASCADE
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+/*after: the last post delivered to each user*/
+CREATE TABLE `NotificationCursors` (
+  `userID` smallint(5) unsigned NOT NULL,
+  `lastPostID` smallint(5) unsigned NOT NULL DEFAULT 0,
+  PRIMARY KEY (`userID`),
+  CONSTRAINT `fk_NotificationCursors_1` FOREIGN KEY (`userID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+insert into Users (userName, passwordHash)
+values  ('alex', '17663506432727786073'), ('ben', '12927111708687947557'),
+		('cris', '11740314204215096121'), ('don', '12745502948907907845'),
+        ('eddy', '4771635686586901585'), ('fred', '3210639344949365877'),
+        ('george', '6136068120051800929'), ('honey', '9050044803222492725'),
+        ('imy', '1091350801367770665'), ('jack', '7868285383349367941'),
+        ('krish', '15963054882994457561'), ('lilly', '16906882082752180197'),
+        ('mary', '18327857878878084177'), ('noah', '5069992954181438069'),
+        ('omar', '1260992177983512433'), ('pretty', '10940044000550006709'),
+        ('quinton', '4523305108125428409'), ('roger', '18264053755285864037'),
+        ('sam', '9499914711864451609'), ('tom', '10229820929279828485');
+
+insert into NotificationCursors (userID, lastPostID)
+select userID, 0 from Users;
+
+/*rows InnoDB inserted or updated so far, a duplicate key turned into an update counts once*/
+CREATE FUNCTION `rows_written`() RETURNS bigint READS SQL DATA
+	RETURN (select sum(variable_value) from performance_schema.global_status
+		where variable_name in ('Innodb_rows_inserted', 'Innodb_rows_updated'));
+
+CREATE TABLE `Results` (
+  `schemaName` varchar(25) NOT NULL,
+  `posts` int NOT NULL,
+  `rowsWritten` bigint NOT NULL,
+  `statements` int NOT NULL,
+  `tableRows` int NOT NULL,
+  PRIMARY KEY (`schemaName`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+
+DELIMITER //
+
+/*QUERY_INSERT_POST and QUERY_INSERT_NOTIFICATIONS per post, QUERY_MARK_READ per post and online user*/
+CREATE PROCEDURE `bench_notifications`()
+BEGIN
+	DECLARE post, user_id, stmt_count INT DEFAULT 0;
+	DECLARE post_id INT;
+	DECLARE written BIGINT;
+
+	SET written = rows_written();
+	WHILE post < @posts DO
+		insert into Posts (posterUserID, posteeUserID, content)
+		select 1, postee.userID, 'write amplification' from Users postee where postee.userName = 'ben';
+		SET post_id = last_insert_id();
+		insert into Notifications (postID, userID) select post_id, userID from Users;
+		SET stmt_count = stmt_count + 2;
+		SET user_id = 1;
+		WHILE user_id <= @online DO
+			update Notifications set readFlag = 1 where postID = post_id and userID = user_id;
+			SET stmt_count = stmt_count + 1;
+			SET user_id = user_id + 1;
+		END WHILE;
+		SET post = post + 1;
+	END WHILE;
+	insert into Results select 'Notifications', @posts, rows_written() - written, stmt_count, count(*) from Notifications;
+END //
+
+/*QUERY_INSERT_POST per post, QUERY_ADVANCE_CURSORS per round for each NOTIFICATION_READ_BATCH (16) online users*/
+CREATE PROCEDURE `bench_cursors`()
+BEGIN
+	DECLARE post, user_id, stmt_count INT DEFAULT 0;
+	DECLARE post_id INT;
+	DECLARE written BIGINT;
+
+	SET written = rows_written();
+	WHILE post < @posts DO
+		insert into Posts (posterUserID, posteeUserID, content)
+		select 1, postee.userID, 'write amplification' from Users postee where postee.userName = 'ben';
+		SET post_id = last_insert_id();
+		SET stmt_count = stmt_count + 1;
+		SET post = post + 1;
+		IF post % @posts_per_round = 0 OR post = @posts THEN
+			SET user_id = 1;
+			WHILE user_id <= @online DO
+				insert into NotificationCursors (userID, lastPostID)
+				select userID, post_id from Users where userID between user_id and least(user_id + 15, @online)
+				on duplicate key update lastPostID = greatest(lastPostID, values(lastPostID));
+				SET stmt_count = stmt_count + 1;
+				SET user_id = user_id + 16;
+			END WHILE;
+		END IF;
+	END WHILE;
+	insert into Results select 'NotificationCursors', @posts, rows_written() - written, stmt_count, count(*) from NotificationCursors;
+END //
+
+DELIMITER ;
+
+call bench_notifications();
+call bench_cursors();
+
+select schemaName, posts, rowsWritten, statements, tableRows,
+	rowsWritten / posts rowsPerPost, statements / posts statementsPerPost
+from Results order by schemaName desc;
+
+DROP DATABASE `SocialNetworkBench`;
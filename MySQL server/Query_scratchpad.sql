@@ -1,6 +1,6 @@
 /*for deleting everything*/
 DROP TABLE `SocialNetwork`.`InteractionLog`;
-DROP TABLE `SocialNetwork`.`Notifications`;
+DROP TABLE `SocialNetwork`.`NotificationCursors`;
 DROP TABLE `SocialNetwork`.`Posts`;
 DROP TABLE `SocialNetwork`.`Users`;
 
@@ -31,19 +31,12 @@ CREATE TABLE `SocialNetwork`.`Posts` (
   CONSTRAINT `fk_Posts_2` FOREIGN KEY (`posteeUserID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE
 ) ENGINE=InnoDB DEFAULT CHARSET=latin1;
 
-CREATE TABLE `SocialNetwork`.`Notifications` (
-  `notificationID` smallint(5) unsigned NOT NULL AUTO_INCREMENT,
-  `postID` smallint(5) unsigned NOT NULL,
+/*last post delivered to each user, newer posts are their pending notifications*/
+CREATE TABLE `SocialNetwork`.`NotificationCursors` (
   `userID` smallint(5) unsigned NOT NULL,
-  `readFlag` boolean NOT NULL DEFAULT 0,
-  `timestamp` datetime(6) NOT NULL DEFAULT NOW(6),
-  PRIMARY KEY (`notificationID`),
-  UNIQUE KEY `notificationID_UNIQUE` (`notificationID`),
-  UNIQUE KEY `post_user_UNIQUE` (`postID`,`userID`),
-  KEY `fk_Notifications_1_idx` (`userID`),
-  CONSTRAINT `fk_Notifications_1` FOREIGN KEY (`userID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE,
-  KEY `fk_Notifications_2_idx` (`postID`),
-  CONSTRAINT `fk_Notifications_2` FOREIGN KEY (`postID`) REFERENCES `Posts` (`postID`) ON DELETE CASCADE ON UPDATE CASCADE
+  `lastPostID` smallint(5) unsigned NOT NULL DEFAULT 0,
+  PRIMARY KEY (`userID`),
+  CONSTRAINT `fk_NotificationCursors_1` FOREIGN KEY (`userID`) REFERENCES `Users` (`userID`) ON DELETE CASCADE ON UPDATE CASCADE
 ) ENGINE=InnoDB DEFAULT CHARSET=latin1;
 
 CREATE TABLE `SocialNetwork`.`InteractionLog` (
@@ -71,3 +64,6 @@ values  ('alex', '17663506432727786073'), ('ben', '12927111708687947557'),
         ('omar', '1260992177983512433'), ('pretty', '10940044000550006709'),
         ('quinton', '4523305108125428409'), ('roger', '18264053755285864037'),
         ('sam', '9499914711864451609'), ('tom', '10229820929279828485');
+
+insert into SocialNetwork.NotificationCursors (userID, lastPostID)
+select userID, 0 from SocialNetwork.Users;
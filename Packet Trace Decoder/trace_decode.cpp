@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "packet_trace.h"
+
+/* decodes the packet traces the server writes with -T, build with: g++ -std=c++11 -o trace_decode trace_decode.cpp */
+
+using namespace std;
+
+static const char *commandNames[] = { "LOGIN", "LOGOUT", "POST", "SHOW", "LIST", "NOTIFY", "ACK" };	/* order of enum commands, structures.h */
+#define COMMAND_COUNT (sizeof(commandNames) / sizeof(commandNames[0]))
+#define NOTIFY_CODE 5
+#define ACK_CODE 6
+
+/*
+ * commandStats - packets of one command in one direction
+ * ack_us: ACK latencies of writes that waited for them
+ * response_us: from a request to its response (same connection, command and req_num), counted on the response
+ */
+struct commandStats {
+	unsigned long count;
+	unsigned long long bytes;
+	vector<uint32_t> ack_us;
+	vector<uint32_t> response_us;
+};
+
+/*
+ * readTrace() - append the records of a trace file
+ * path: the trace file
+ * records: to append them to
+ * dropped: to add the records the server dropped to
+ * return 0 on success
+ * return -1 if the file cannot be read or is not a packet trace
+ */
+static int readTrace(const char *path, vector<struct packetTraceRecord> &records, unsigned long long &dropped)
+{
+	struct packetTraceHeader header;
+	FILE *trace = fopen(path, "rb");
+	long size;
+	uint64_t count;
+
+	if (trace == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, trace) != 1 || memcmp(header.magic, PACKET_TRACE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "%s: not a packet trace\n", path);
+		fclose(trace);
+		return -1;
+	}
+	if (header.version != PACKET_TRACE_VERSION || header.record_size != sizeof(struct packetTraceRecord))
+	{
+		fprintf(stderr, "%s: trace version %u with %u byte records, this decoder reads version %d\n", path,
+				header.version, header.record_size, PACKET_TRACE_VERSION);
+		fclose(trace);
+		return -1;
+	}
+	fseek(trace, 0, SEEK_END);
+	size = ftell(trace);
+	fseek(trace, sizeof(header), SEEK_SET);
+	count = header.records;
+	if (count > (size - sizeof(header)) / sizeof(struct packetTraceRecord)) /* cut short by a crash or a copy */
+		count = (size - sizeof(header)) / sizeof(struct packetTraceRecord);
+
+	size_t first = records.size();
+	records.resize(first + count);
+	count = fread(&records[first], sizeof(struct packetTraceRecord), count, trace);
+	records.resize(first + count);
+	dropped += header.dropped;
+	fclose(trace);
+	return 0;
+}
+
+/*
+ * percentile() - nearest rank percentile of latencies
+ * sorted: latencies in microseconds, sorted, not empty
+ * return the percentile in ms
+ */
+static double percentile(vector<uint32_t> &sorted, double p)
+{
+	size_t rank = (size_t) (p / 100 * sorted.size() + 0.999999);
+	if (rank == 0)
+		rank = 1;
+	if (rank > sorted.size())
+		rank = sorted.size();
+	return sorted[rank - 1] / 1000.0;
+}
+
+static void printLatencies(const char *name, vector<uint32_t> &latencies)
+{
+	if (latencies.empty())
+		return;
+	sort(latencies.begin(), latencies.end());
+	printf("\t%-8s n=%-8zu p50 %9.3f  p90 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f ms\n", name, latencies.size(),
+			percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99), percentile(latencies, 99.9),
+			latencies.back() / 1000.0);
+}
+
+static const char *commandName(uint16_t cmd_code)
+{
+	return cmd_code < COMMAND_COUNT ? commandNames[cmd_code] : "?";
+}
+
+static void dumpRecord(struct packetTraceRecord &record)
+{
+	time_t seconds = record.time_ns / 1000000000ULL;
+	struct tm local;
+	char at[32];
+
+	localtime_r(&seconds, &local);
+	strftime(at, sizeof(at), "%Y-%m-%d %H:%M:%S", &local);
+	printf("%s.%06llu conn %5u/%-5u %-5s %-6s num %-10u sid %-10u %6u bytes", at,
+			(unsigned long long) (record.time_ns % 1000000000ULL / 1000), record.connection & 0xffff, record.connection >> 16,
+			record.direction == PACKET_TRACE_READ ? "read" : "write", commandName(record.cmd_code), record.req_num,
+			record.sessionId, record.bytes);
+	if (record.flags & PACKET_TRACE_ACKED)
+		printf("  ACK after %.3f ms", record.latency_us / 1000.0);
+	else if (record.flags & PACKET_TRACE_WINDOWED)
+		printf("  windowed");
+	else if (record.flags & PACKET_TRACE_IMPLICIT)
+		printf("  implicit");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	vector<struct packetTraceRecord> records;
+	unsigned long long dropped = 0;
+	bool dump = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dump = true;
+			break;
+		default:
+			printf("Error: Usage is ./trace_decode [-d] trace_file... (oldest first, e.g. trace.1 trace)\n");
+			return -1;
+		}
+	}
+	if (optind == argc)
+	{
+		printf("Error: Usage is ./trace_decode [-d] trace_file... (oldest first, e.g. trace.1 trace)\n");
+		return -1;
+	}
+	for (int i = optind; i < argc; i++)
+		if (readTrace(argv[i], records, dropped) < 0)
+			return -1;
+
+	/* the log writer takes the records of one thread after another, put them back in time order */
+	stable_sort(records.begin(), records.end(), [](const struct packetTraceRecord &a, const struct packetTraceRecord &b) {
+		return a.time_ns < b.time_ns;
+	});
+
+	struct commandStats stats[COMMAND_COUNT + 1][2];
+	unordered_map<string, struct packetTraceRecord> requests; /* request waiting for its response, by connection, command and req_num */
+	for (auto &s : stats)
+		for (auto &d : s)
+			d.count = d.bytes = 0;
+	for (auto &record : records)
+	{
+		if (dump)
+			dumpRecord(record);
+		struct commandStats &s = stats[min<size_t>(record.cmd_code, COMMAND_COUNT)][record.direction ? 1 : 0];
+		s.count++;
+		s.bytes += record.bytes;
+		if (record.flags & PACKET_TRACE_ACKED)
+			s.ack_us.push_back(record.latency_us);
+		if (record.cmd_code == ACK_CODE || record.cmd_code == NOTIFY_CODE) /* not a request or a response */
+			continue;
+
+		char key[32];
+		snprintf(key, sizeof(key), "%u %u %u", record.connection, record.cmd_code, record.req_num);
+		auto request = requests.find(key);
+		if (request == requests.end() || request->second.direction == record.direction) /* a request, or a retry of it */
+			requests[key] = record;
+		else
+		{
+			s.response_us.push_back((record.time_ns - request->second.time_ns) / 1000);
+			requests.erase(request);
+		}
+	}
+
+	if (records.empty())
+	{
+		printf("No records, %llu dropped\n", dropped);
+		return 0;
+	}
+	printf("%zu records over %.3f s, %llu dropped, %zu requests without a response\n", records.size(),
+			(records.back().time_ns - records.front().time_ns) / 1e9, dropped, requests.size());
+	for (size_t cmd = 0; cmd <= COMMAND_COUNT; cmd++)
+		for (int direction = 0; direction < 2; direction++)
+		{
+			struct commandStats &s = stats[cmd][direction];
+			if (s.count == 0)
+				continue;
+			printf("%-6s %-5s %10lu packets %12llu bytes\n", cmd < COMMAND_COUNT ? commandNames[cmd] : "?",
+					direction ? "write" : "read", s.count, s.bytes);
+			printLatencies("ACK", s.ack_us);
+			printLatencies("response", s.response_us);
+		}
+	return 0;
+}
@@ -21,6 +21,14 @@ using namespace std;
 
 string username;
 unsigned int sessionID;
+pthread_mutex_t viewLock = PTHREAD_MUTEX_INITIALIZER;	/* guards the wall and list state below, set by the stdin and socket threads */
+string wallShown;	/* wall of the last SHOW */
+unsigned int wallNext;	/* before of its next page, 0 if there is none */
+unordered_map<unsigned int, struct wallRequest> wallRequests;	/* SHOW requests sent and not answered yet, by req_num */
+unsigned int wallLatest;	/* req_num of the last SHOW, only its response sets wallNext */
+string wallVersion, wallPage;	/* version and posts of the newest page of wallShown, to show again when UNCHANGED */
+unsigned int wallPageNext;	/* next of that page */
+string listVersion, listShown;	/* version and contents of the last LIST */
 
 void getLoginInfo(string &pw);
 int enterLoginMode(string servername, int serverport);
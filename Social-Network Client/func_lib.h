@@ -19,26 +19,41 @@
 
 using namespace std;
 
+/*
+ * wallRequest - a SHOW request waiting for its response
+ * wall: wall owner asked for
+ * newest: asked for the newest page, whose response is kept to show again when UNCHANGED
+ */
+struct wallRequest {
+	string wall;
+	bool newest;
+};
+
 void getLoginInfo(string &pw);
 int enterLoginMode(string servername, int serverport);
 int enterWebBrowserMode(string servername, int serverport);
 
 
 void readThread(int sock_fd);
-int sendPacket(int sock_fd, enum commands cmd_code, string key, string value);
+int sendPacket(int sock_fd, enum commands cmd_code, string key, string value, unsigned int *req_num = NULL);
 void list(int sock_fd);
 void printCmdList();
 void post(int sock_fd);
 void show(int sock_fd);
+void showOlder(int sock_fd);
+void sendShow(int sock_fd, string name, string page, bool newest);
 void logout(int sock_fd);
 void createLoginPacket(string username, string pw, struct packet &pkt);
 void createPostPacket(string postee, string post, struct packet &pkt);
-void createShowPacket(string wallOwner, struct packet &pkt);
+void createShowPacket(string wallOwner, string page, struct packet &pkt);
+void createListPacket(string version, struct packet &pkt);
 
 void writeThread(int sock_fd);
 int parsePacket(struct packet *req);
 void displayContents(struct packet *resp);
+void displayView(struct packet *resp);
 int processResponse(int sock_fd, struct packet *resp);
+bool isLoginAccepted(struct packet *resp);
 
 
 #endif /* FUNC_LIB_H_ */
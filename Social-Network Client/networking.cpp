@@ -1,19 +1,385 @@
 #include "networking.h"
+#include "packet_log.h"
 
 unsigned int packetSeqNum = 0;
 bool isServer = false;
-int bufferOccupied = 0;
-struct packet bufferPkts[10];
 
 pthread_mutex_t seqNumlock;
-pthread_mutex_t bufferPktlock;
-pthread_mutex_t logFilelock;
+pthread_mutex_t connTablelock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * connection - per socket state, indexed by socket fd
+ * wireMode: format used when writing to the socket
+ * rxLock: held by the one thread reading the socket, guards the receive fields below
+ * bufLock: guards pendingAcks, bufferedPkts, rxWaiting, rxDeferred and the wire state (wireMode, window, implicitAck)
+ * rxWaiting: threads waiting in read_socket; ACK waiters leave the socket to them
+ * rxDeferred: read_socket_nowait found the socket taken, its reader hands it to pendingHandler when done
+ * rxCond: signalled (under bufLock) when a reader routes a packet or gives up the socket
+ * pendingAcks: one slot per write_socket waiting for its ACK, keyed by ack_key(req_num, content_len)
+ * bufferedPkts: requests read by a thread waiting for its ACK, in arrival order, for read_socket
+ * window: windowed frames a writer may have unacknowledged, 0 to wait for the ACK of each frame
+ * implicitAck: requests and responses go unacknowledged, only NOTIFY is windowed
+ * txLock: held while writing a frame so partial writes of two threads never interleave,
+ *         windowed frames also go on the wire in the order they were counted under it
+ * txSent, txAcked: windowed frames written / cumulatively acknowledged by the peer (under bufLock)
+ * rxFlags: header flags of the frame receive_frame returned last
+ * rxCount, rxUnacked: windowed frames received / not acknowledged to the peer yet (under rxLock)
+ * rxBuffer: bytes read from the socket, [rxStart, rxEnd) is not consumed yet
+ * rxScanned: bytes of the current frame the parser has already looked at
+ * rxContentLen: content_len digits of the current text frame parsed so far
+ * rxFrameLen: length of the current frame, 0 until the header has been parsed
+ * queueLock: guards txQueue, txDropped and txDraining
+ * txQueue: packets queued by enqueue_socket, written in order by the drain threads
+ * txDropped: queued packets that will not be written, for a drain thread to report
+ * txDraining: the socket is in drainReady or a drain thread is writing it, never both
+ * txShutdown: the queue policy shut the connection down, nothing more is queued for it
+ * reuses: times the slot was reset, tells connections on the same fd apart in the packet log
+ * slots are reset rather than freed on close so a late writer never touches freed memory
+ */
+struct pendingAck {
+	bool received;
+	unsigned int sessionId;
+};
+
+struct bufferedPkt {
+	struct packet pkt;
+	int frameLen;
+	uint16_t flags;
+};
+
+struct outboundPkt {
+	struct packet pkt;
+	uint64_t tag;
+	int result;
+};
+
+struct connection {
+	enum wireModes wireMode;
+	pthread_mutex_t rxLock;
+	pthread_cond_t rxCond;
+	pthread_mutex_t bufLock;
+	int rxWaiting;
+	bool rxDeferred;
+	unordered_map<uint64_t, struct pendingAck> pendingAcks;
+	deque<struct bufferedPkt> bufferedPkts;
+	unsigned int window;
+	bool implicitAck;
+	pthread_mutex_t txLock;
+	unsigned int txSent;
+	unsigned int txAcked;
+	uint16_t rxFlags;
+	unsigned int rxCount;
+	unsigned int rxUnacked;
+	char rxBuffer[RX_BUFFER_LEN];
+	int rxStart;
+	int rxEnd;
+	int rxScanned;
+	unsigned int rxContentLen;
+	int rxFrameLen;
+	pthread_mutex_t queueLock;
+	deque<struct outboundPkt> txQueue;
+	deque<struct outboundPkt> txDropped;
+	bool txDraining;
+	bool txShutdown;
+	unsigned int reuses;
+};
+
+static struct connection *connTable[MAX_CONNECTIONS];
+static void (*pendingHandler)(int socketfd) = NULL;
+static void (*deliveredHandler)(int socketfd, uint64_t tag, int result) = NULL;
+static void (*ackHandler)(struct packet &pkt, double response_ms) = NULL;
+static enum queuePolicies queuePolicy = QUEUE_COALESCE;
+static unsigned int maxQueuedPkts = DEFAULT_QUEUE_LEN;
+static pthread_once_t drainOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;	//guards drainReady
+static pthread_cond_t drainCond = PTHREAD_COND_INITIALIZER;	//signalled when a socket is put in drainReady
+static deque<int> drainReady;	//sockets with queued packets waiting for a drain thread, each at most once
+static int drainThreads = 0;	//drain threads running, set once by start_drain_threads
 
 const char * getCommand(int enumVal)
 {
   return commandList[enumVal];
 }
 
+struct connection *get_connection(int socketfd) {
+	if(socketfd < 0 || socketfd >= MAX_CONNECTIONS)
+		return NULL;
+	struct connection *conn = __atomic_load_n(&connTable[socketfd], __ATOMIC_ACQUIRE);
+	if(conn != NULL)
+		return conn;
+
+	pthread_mutex_lock(&connTablelock);
+	conn = connTable[socketfd];
+	if(conn == NULL) {
+		conn = new struct connection;
+		conn->wireMode = WIRE_TEXT;
+		pthread_mutex_init(&conn->rxLock, NULL);
+		pthread_cond_init(&conn->rxCond, NULL);
+		pthread_mutex_init(&conn->bufLock, NULL);
+		pthread_mutex_init(&conn->txLock, NULL);
+		pthread_mutex_init(&conn->queueLock, NULL);
+		conn->txDraining = conn->txShutdown = false;
+		conn->rxWaiting = 0;
+		conn->rxDeferred = false;
+		conn->window = 0;
+		conn->implicitAck = false;
+		conn->txSent = conn->txAcked = 0;
+		conn->rxFlags = 0;
+		conn->rxCount = conn->rxUnacked = 0;
+		conn->rxStart = conn->rxEnd = 0;
+		conn->rxScanned = conn->rxFrameLen = 0;
+		conn->rxContentLen = 0;
+		conn->reuses = 0;
+		__atomic_store_n(&connTable[socketfd], conn, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&connTablelock);
+	return conn;
+}
+
+void reset_connection(int socketfd) {
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return;
+	__atomic_add_fetch(&conn->reuses, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&conn->rxLock);
+	conn->rxStart = conn->rxEnd = 0;
+	conn->rxScanned = conn->rxFrameLen = 0;
+	conn->rxContentLen = 0;
+	conn->rxFlags = 0;
+	conn->rxCount = conn->rxUnacked = 0;
+	pthread_mutex_unlock(&conn->rxLock);
+	pthread_mutex_lock(&conn->bufLock);
+	conn->wireMode = WIRE_TEXT;
+	conn->window = 0;
+	conn->implicitAck = false;
+	conn->pendingAcks.clear();	//writers still waiting find their slot gone and fail
+	conn->bufferedPkts.clear();
+	conn->txSent = conn->txAcked = 0;
+	pthread_cond_broadcast(&conn->rxCond);
+	pthread_mutex_unlock(&conn->bufLock);
+	pthread_mutex_lock(&conn->queueLock);
+	conn->txShutdown = false;
+	while(!conn->txQueue.empty()) {	//a drain thread reports them, they were for the closed peer
+		conn->txQueue.front().result = -2;
+		conn->txDropped.push_back(conn->txQueue.front());
+		conn->txQueue.pop_front();
+	}
+	pthread_mutex_unlock(&conn->queueLock);
+}
+
+//connection of a packetTraceRecord: the fd in the low 16 bits (MAX_CONNECTIONS), the reuses of its slot above
+static inline uint32_t log_connection(struct connection *conn, int socketfd) {
+	return (__atomic_load_n(&conn->reuses, __ATOMIC_RELAXED) << 16) | socketfd;
+}
+
+//an ACK carries the req_num and content_len of the frame it acknowledges, together they pick the waiting writer
+static inline uint64_t ack_key(unsigned int reqNum, unsigned int contentLen) {
+	return ((uint64_t) reqNum << 32) | contentLen;
+}
+
+//give up reading the socket and wake threads waiting for a buffered packet or for the socket
+//pending: frames were left in the buffers, an event loop must read them without an event from epoll
+void release_reader(struct connection *conn, int socketfd, bool pending) {
+	pthread_mutex_unlock(&conn->rxLock);
+	pthread_mutex_lock(&conn->bufLock);
+	pending = pending || conn->rxDeferred;	//or a loop went back to epoll while we held the socket
+	conn->rxDeferred = false;
+	pthread_cond_broadcast(&conn->rxCond);
+	pthread_mutex_unlock(&conn->bufLock);
+	if(pending && pendingHandler != NULL)
+		pendingHandler(socketfd);
+}
+
+//hand a frame read while holding rxLock to the thread it belongs to
+//ACKs fill the slot of their writer (dropped if nobody waits for them any more), requests are queued for read_socket
+//return 0 if success
+//return -4 if the request queue is full
+static int route_frame(struct connection *conn, struct packet &pkt, int frameLen) {
+	int ret = 0;
+	pthread_mutex_lock(&conn->bufLock);
+	if(pkt.cmd_code == ACK && (conn->rxFlags & WIRE_FLAG_CUMULATIVE)) {
+		if((int)(pkt.req_num - conn->txAcked) > 0)
+			conn->txAcked = pkt.req_num;
+	} else if(pkt.cmd_code == ACK) {
+		auto slot = conn->pendingAcks.find(ack_key(pkt.req_num, pkt.content_len));
+		if(slot != conn->pendingAcks.end()) {
+			slot->second.received = true;
+			slot->second.sessionId = pkt.sessionId;
+		}
+	} else if(conn->bufferedPkts.size() < MAX_BUFFERED_PKTS) {
+		conn->bufferedPkts.push_back({pkt, frameLen, conn->rxFlags});
+	} else {
+		fprintf(stderr, "Buffer Queue Full\n");
+		ret = -4;
+	}
+	pthread_cond_broadcast(&conn->rxCond);
+	pthread_mutex_unlock(&conn->bufLock);
+	return ret;
+}
+
+static int remaining_ms(chrono::steady_clock::time_point deadline) {
+	auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+	return left > 0 ? (int) left : 0;
+}
+
+static struct timespec realtime_after_ms(int ms) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (long)(ms % 1000) * 1000000;
+	if(until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	return until;
+}
+
+void set_pending_handler(void (*handler)(int socketfd)) {
+	pendingHandler = handler;
+}
+
+enum wireModes get_wire_mode(int socketfd) {
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return WIRE_TEXT;
+	pthread_mutex_lock(&conn->bufLock);
+	enum wireModes mode = conn->wireMode;
+	pthread_mutex_unlock(&conn->bufLock);
+	return mode;
+}
+
+string wire_offer() {
+	return string(WIRE_OFFER) + " wire=binary ack=window:" + to_string(MAX_WINDOW) + " ack=implicit";
+}
+
+//the window size in a capability string, 0 if there is none
+static unsigned int wire_window(string &capabilities) {
+	size_t found = capabilities.find(" ack=window:");
+	if(found == string::npos)
+		return 0;
+	return (unsigned int) strtoul(capabilities.c_str() + found + strlen(" ack=window:"), NULL, 10);
+}
+
+string wire_negotiate(string offer) {
+	string accept;
+
+	if(offer.compare(0, strlen(WIRE_OFFER), WIRE_OFFER) != 0)
+		return string();
+	if(offer.find(" wire=binary") != string::npos) {
+		accept += " wire=binary";
+		unsigned int window = wire_window(offer);	//windowed frames need the flags of the binary header
+		if(window > MAX_WINDOW)
+			window = MAX_WINDOW;
+		if(window > 0)
+			accept += " ack=window:" + to_string(window);
+		if(offer.find(" ack=implicit") != string::npos)
+			accept += " ack=implicit";
+	}
+	if(accept.length() == 0)
+		return string();
+	return string(WIRE_ACCEPT) + accept;
+}
+
+int wire_apply(int socketfd, string accept) {
+	if(accept.compare(0, strlen(WIRE_ACCEPT), WIRE_ACCEPT) != 0)
+		return -1;
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return -1;
+	if(accept.find(" wire=binary") != string::npos) {
+		unsigned int window = wire_window(accept);
+		bool implicitAck = accept.find(" ack=implicit") != string::npos;
+		if(window > MAX_WINDOW)
+			window = MAX_WINDOW;
+		if(implicitAck && window == 0)
+			window = MAX_WINDOW;	//NOTIFY is still acknowledged, in batches
+		//all at once, a drain thread may be writing a NOTIFY to the socket that just logged in
+		pthread_mutex_lock(&conn->bufLock);
+		conn->wireMode = WIRE_BINARY;
+		conn->window = window;
+		conn->implicitAck = implicitAck;
+		pthread_mutex_unlock(&conn->bufLock);
+	}
+	return 0;
+}
+
+//the value of " key=" in a capability or paging string, empty if there is none
+static string wire_token(string &line, const char *key) {
+	string find = string(" ") + key + "=";
+	size_t found = line.find(find);
+	if(found == string::npos)
+		return string();
+	found += find.length();
+	return line.substr(found, line.find_first_of(" \n", found) - found);
+}
+
+string wall_page_request(unsigned int before, unsigned int limit, string version) {
+	string request = string(WALL_PAGE) + " before=" + to_string(before) + " limit=" + to_string(limit);
+	if(version.length())
+		request += " version=" + version;
+	return request;
+}
+
+int wall_page_parse(string request, unsigned int *before, unsigned int *limit, string *version) {
+	string token;
+
+	if(request.compare(0, strlen(WALL_PAGE), WALL_PAGE) != 0)
+		return -1;
+	*before = (unsigned int) strtoul(wire_token(request, "before").c_str(), NULL, 10);
+	token = wire_token(request, "limit");
+	*limit = token.length() ? (unsigned int) strtoul(token.c_str(), NULL, 10) : WALL_PAGE_LIMIT;
+	*version = wire_token(request, "version");
+	return 0;
+}
+
+string wall_page_header(unsigned int next, string version) {
+	return string(WALL_PAGE) + " next=" + to_string(next) + " version=" + version + "\n";
+}
+
+int wall_page_split(string &response, unsigned int *next, string *version) {
+	if(response.compare(0, strlen(WALL_PAGE " next="), WALL_PAGE " next=") != 0)
+		return -1;
+	size_t end = response.find('\n');
+	string header = response.substr(0, end);
+	*next = (unsigned int) strtoul(wire_token(header, "next").c_str(), NULL, 10);
+	*version = wire_token(header, "version");
+	response.erase(0, end == string::npos ? response.length() : end + 1);
+	return 0;
+}
+
+string list_request(string version) {
+	return string(LIST_VERSION) + " version=" + version;
+}
+
+int list_parse(string request, string *version) {
+	if(request.compare(0, strlen(LIST_VERSION " version="), LIST_VERSION " version=") != 0)
+		return -1;
+	*version = wire_token(request, "version");
+	return 0;
+}
+
+string list_header(string version) {
+	return string(LIST_VERSION) + " version=" + version + "\n";
+}
+
+int list_split(string &response, string *version) {
+	if(response.compare(0, strlen(LIST_VERSION " version="), LIST_VERSION " version=") != 0)
+		return -1;
+	size_t end = response.find('\n');
+	string header = response.substr(0, end);
+	*version = wire_token(header, "version");
+	response.erase(0, end == string::npos ? response.length() : end + 1);
+	return 0;
+}
+
+string unchanged_response(string version) {
+	return string(UNCHANGED) + " version=" + version;
+}
+
+bool is_unchanged(string response) {
+	return response.compare(0, strlen(UNCHANGED " version="), UNCHANGED " version=") == 0;
+}
+
 int create_server_socket(int portNum) {
 	isServer = true;
 	int socketfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -108,6 +474,7 @@ int create_client_socket(string serverName, int portNum) {
 		fprintf(stderr, "setsockopt(SO_REUSEPORT) failed; Error Message: %s\n", strerror_r(errno, errorMessage, ERR_LEN));
 		return -4;
 	}
+	reset_connection(socketfd);
 
 	return socketfd;
 }
@@ -121,11 +488,13 @@ int accept_socket(int socketfd) {
 		fprintf(stderr, "Failed to Accept Socket; Error Message: %s\n", strerror_r(errno, errorMessage, ERR_LEN));
 		return -1;
 	}
+	reset_connection(slaveSocket);
 
 	return slaveSocket;
 }
 
 int destroy_socket(int socketfd) {
+	reset_connection(socketfd);
 	if(close(socketfd) < 0) {
 		char errorMessage[ERR_LEN];
 		fprintf(stderr, "Failed to Close Socket; Error Message: %s\n", strerror_r(errno, errorMessage, ERR_LEN));
@@ -134,11 +503,171 @@ int destroy_socket(int socketfd) {
 	return 0;
 }
 
+static void put_u32(char *&cursor, uint32_t value) {
+	value = htonl(value);
+	memcpy(cursor, &value, 4);
+	cursor += 4;
+}
+
+static void put_field(char *&cursor, string &field) {
+	put_u32(cursor, (uint32_t) field.length());
+	memcpy(cursor, field.data(), field.length());
+	cursor += field.length();
+}
+
+static uint32_t get_u32(const char *cursor) {
+	uint32_t value;
+	memcpy(&value, cursor, 4);
+	return ntohl(value);
+}
+
+static int get_field(const char *&cursor, const char *end, string &field) {
+	if(end - cursor < 4)
+		return -1;
+	uint32_t length = get_u32(cursor);
+	cursor += 4;
+	if((uint32_t)(end - cursor) < length)
+		return -1;
+	field.assign(cursor, length);
+	cursor += length;
+	return 0;
+}
+
+//content_len as carried by the header of the given format
+unsigned int wire_content_len(struct packet &pkt, enum wireModes mode) {
+	if(mode == WIRE_BINARY) {
+		if(pkt.cmd_code == ACK)
+			return pkt.content_len;	//an ACK echoes the content_len of the acknowledged frame
+		return 6 * 4 + pkt.contents.username.length() + pkt.contents.password.length() + pkt.contents.postee.length() + pkt.contents.post.length() + pkt.contents.wallOwner.length() + pkt.contents.rcvd_cnts.length();
+	}
+	return to_string(pkt.cmd_code).length() + to_string(pkt.req_num).length() + to_string(pkt.sessionId).length() + pkt.contents.username.length() + pkt.contents.password.length() + pkt.contents.postee.length() + pkt.contents.post.length() + pkt.contents.wallOwner.length() + pkt.contents.rcvd_cnts.length();
+}
+
+//write all of a frame, waiting for room on a non-blocking socket; the caller holds conn->txLock
+static int send_frame(int socketfd, const char *frame, int frameLen) {
+	char errorMessage[ERR_LEN];
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(TIMEOUT_SEC);
+	int written = 0;
+
+	while(written < frameLen) {
+		//no SIGPIPE for a peer that is gone (or that enqueue_socket shut down), the error is reported instead
+		int byteWritten = send(socketfd, frame + written, frameLen - written, MSG_NOSIGNAL);
+		if(byteWritten < 0 && errno == EINTR)
+			continue;
+		if(byteWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd;
+			pfd.fd = socketfd;
+			pfd.events = POLLOUT;
+			int waitMs = remaining_ms(deadline);
+			if(waitMs == 0 || poll(&pfd, 1, waitMs) == 0) {
+				fprintf(stderr, "Error (write): timed out\n");
+				return -1;
+			}
+			continue;
+		}
+		if(byteWritten < 0) {
+			fprintf(stderr, "Error (write): %s\n", strerror_r(errno, errorMessage, ERR_LEN));
+			return -1;
+		}
+		written += byteWritten;
+	}
+	return written;
+}
+
+static int write_frame(int socketfd, const char *frame, int frameLen) {
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return -1;
+	pthread_mutex_lock(&conn->txLock);
+	int written = send_frame(socketfd, frame, frameLen);
+	pthread_mutex_unlock(&conn->txLock);
+	return written;
+}
+
+//put the binary frame of pkt in pktString, return its length or -1 if it is too long
+static int encode_binary(char *pktString, struct packet &pkt, uint16_t flags) {
+	char *cursor = pktString;
+	uint32_t bodyLength = (pkt.cmd_code == ACK) ? 4 : pkt.content_len;
+
+	if(WIRE_HEADER_LEN + bodyLength > MAX_PACKET_LEN) {
+		fprintf(stderr, "Packet too long: %u byte\n", WIRE_HEADER_LEN + bodyLength);
+		return -1;
+	}
+
+	*cursor++ = (char) WIRE_MAGIC;
+	*cursor++ = (char) WIRE_VERSION;
+	*cursor++ = (char)(flags >> 8);
+	*cursor++ = (char)(flags & 0xFF);
+	put_u32(cursor, bodyLength);
+	put_u32(cursor, (uint32_t) pkt.cmd_code);
+	put_u32(cursor, pkt.req_num);
+	put_u32(cursor, pkt.sessionId);
+	if(pkt.cmd_code == ACK) {
+		put_u32(cursor, pkt.content_len);
+	} else {
+		put_field(cursor, pkt.contents.username);
+		put_field(cursor, pkt.contents.password);
+		put_field(cursor, pkt.contents.postee);
+		put_field(cursor, pkt.contents.post);
+		put_field(cursor, pkt.contents.wallOwner);
+		put_field(cursor, pkt.contents.rcvd_cnts);
+	}
+	return (int)(cursor - pktString);
+}
+
+int write_binary_helper(int socketfd, struct packet &pkt, uint16_t flags) {
+	char pktString[MAX_PACKET_LEN];
+	int frameLen = encode_binary(pktString, pkt, flags);
+	if(frameLen < 0)
+		return -1;
+	return write_frame(socketfd, pktString, frameLen);
+}
+
+int read_binary_helper(const char *pktString, int totalRead, struct packet &pkt) {
+	const char *cursor = pktString + 4;
+	const char *end = pktString + totalRead;
+
+	if((unsigned char) pktString[1] != WIRE_VERSION) {
+		fprintf(stderr, "Packet Version Unsupported: %d\n", (unsigned char) pktString[1]);
+		return -1;
+	}
+	uint32_t bodyLength = get_u32(cursor);
+	pkt.cmd_code = static_cast<commands>(get_u32(cursor + 4));
+	pkt.req_num = get_u32(cursor + 8);
+	pkt.sessionId = get_u32(cursor + 12);
+	cursor = pktString + WIRE_HEADER_LEN;
+	if(end - cursor != (long) bodyLength) {
+		fprintf(stderr, "Packet Length Wrong\n");
+		return -5;
+	}
+
+	if(pkt.cmd_code == ACK) {
+		if(bodyLength != 4) {
+			fprintf(stderr, "Packet Format Wrong\n");
+			return -1;
+		}
+		pkt.content_len = get_u32(cursor);
+		return totalRead;
+	}
+
+	pkt.content_len = bodyLength;
+	if(get_field(cursor, end, pkt.contents.username) < 0 || get_field(cursor, end, pkt.contents.password) < 0
+			|| get_field(cursor, end, pkt.contents.postee) < 0 || get_field(cursor, end, pkt.contents.post) < 0
+			|| get_field(cursor, end, pkt.contents.wallOwner) < 0 || get_field(cursor, end, pkt.contents.rcvd_cnts) < 0) {
+		fprintf(stderr, "Packet Format Wrong\n");
+		return -1;
+	}
+	return totalRead;
+}
+
 int write_socket_helper(int socketfd, struct packet &pkt) {
+	if(get_wire_mode(socketfd) == WIRE_BINARY)
+		return write_binary_helper(socketfd, pkt, 0);
+
 	char pktString[MAX_PACKET_LEN];
 
 	strcpy(pktString, "content_len:");	//12, the length of fixed format of packet
-	strcat(pktString, to_string(pkt.content_len).c_str());
+	strcat(pktString, to_string(wire_content_len(pkt, WIRE_TEXT)).c_str());	//the reader frames on it, so never echo a binary length
 	strcat(pktString, ",cmd_code:");	//10
 	strcat(pktString, to_string(pkt.cmd_code).c_str());
 	strcat(pktString, ",req_num:");		//9
@@ -159,60 +688,13 @@ int write_socket_helper(int socketfd, struct packet &pkt) {
 	strcat(pktString, pkt.contents.rcvd_cnts.c_str());
 	//total is 12+10+9+11+10+10+8+6+11+11 = 98
 
-	if(write(socketfd, pktString, strlen(pktString)) < 0) {
-		char errorMessage[ERR_LEN];
-		fprintf(stderr, "Error (write): %s\n", strerror_r(errno, errorMessage, ERR_LEN));
-		return -1;
-	}
-	return (int)strlen(pktString);
+	return write_frame(socketfd, pktString, strlen(pktString));
 }
 
-int read_socket_helper(int socketfd, struct packet &pkt) {
-	int byteRead = 0;
-	int totalRead = 0;
+int read_text_helper(const char *frame, int frameLen, struct packet &pkt) {
 	int startIndex = -1;
 	int endIndex = -1;
-	char errorMessage[ERR_LEN];
-	char *buffer = (char *)malloc(sizeof(char) * MAX_PACKET_LEN);
-	char *bufferHead = buffer;
-	int packetLength = 90;
-
-	// Read each request stream repeatedly
-	while (1 == 1)
-	{
-		byteRead = read(socketfd, buffer, packetLength-totalRead);
-		if (byteRead < 0)
-		{
-			if (errno == EAGAIN)
-				return -9;
-			fprintf(stderr, "Error (read): %s\n", strerror_r(errno, errorMessage, ERR_LEN));
-			free(bufferHead);
-			return -2;
-		}
-		buffer += byteRead;
-		totalRead += byteRead;
-		//check actual length of the packet
-		string temp(bufferHead);
-		startIndex = temp.find("content_len:");
-		endIndex = temp.find(",cmd_code");
-		if(startIndex != -1 && endIndex != -1) {
-			string contentLengthString = temp.substr(startIndex + 12, endIndex - startIndex - 12);
-			packetLength = 98 + contentLengthString.length() + stoi(contentLengthString);
-		} else {
-			packetLength = MAX_PACKET_LEN;
-		}
-		//Break the loop when the request structure is read completely
-		if (byteRead == 0 || packetLength <= totalRead)
-			break;
-	}
-
-	if(bufferHead == NULL || totalRead == 0) {
-		free(bufferHead);
-		return 0;
-	}
-
-	string pktString(bufferHead);
-	free(bufferHead);
+	string pktString(frame, frameLen);
 
 	startIndex = pktString.find("content_len:");	//first ':'
 	endIndex = pktString.find(",cmd_code:");		//first ','
@@ -257,8 +739,7 @@ int read_socket_helper(int socketfd, struct packet &pkt) {
 		return -1;
 	}
 	component = pktString.substr(startIndex + 10, endIndex - startIndex - 10);
-	if (component.length() > 0)
-		pkt.contents.username = component;
+	pkt.contents.username = component;	//also clears what a reused packet held
 
 	startIndex = pktString.find(",password:", endIndex);
 	endIndex = pktString.find(",postee:", startIndex);
@@ -267,8 +748,7 @@ int read_socket_helper(int socketfd, struct packet &pkt) {
 		return -1;
 	}
 	component = pktString.substr(startIndex + 10, endIndex - startIndex - 10);
-	if (component.length() > 0)
-		pkt.contents.password = component;
+	pkt.contents.password = component;
 
 	startIndex = pktString.find(",postee:", endIndex);
 	endIndex = pktString.find(",post:", startIndex);
@@ -277,8 +757,7 @@ int read_socket_helper(int socketfd, struct packet &pkt) {
 		return -1;
 	}
 	component = pktString.substr(startIndex + 8, endIndex - startIndex - 8);
-	if (component.length() > 0)
-		pkt.contents.postee = component;
+	pkt.contents.postee = component;
 
 	startIndex = pktString.find(",post:", endIndex);
 	endIndex = pktString.find(",wallOwner:", startIndex);
@@ -287,8 +766,7 @@ int read_socket_helper(int socketfd, struct packet &pkt) {
 		return -1;
 	}
 	component = pktString.substr(startIndex + 6, endIndex - startIndex - 6);
-	if (component.length() > 0)
-		pkt.contents.post = component;
+	pkt.contents.post = component;
 
 	startIndex = pktString.find(",wallOwner:", endIndex);
 	endIndex = pktString.find(",rcvd_cnts:", startIndex);
@@ -297,19 +775,199 @@ int read_socket_helper(int socketfd, struct packet &pkt) {
 		return -1;
 	}
 	component = pktString.substr(startIndex + 11, endIndex - startIndex - 11);
-	if (component.length() > 0)
-		pkt.contents.wallOwner = component;
+	pkt.contents.wallOwner = component;
 
 	startIndex = pktString.find(",rcvd_cnts:", endIndex);
 	if(startIndex == -1) {
 		fprintf(stderr, "Packet Format Wrong10\n");
 		return -1;
 	}
-	component = pktString.substr(startIndex + 11, packetLength - startIndex - 11);
-	if (component.length() > 0)
-		pkt.contents.rcvd_cnts = component;
+	component = pktString.substr(startIndex + 11, frameLen - startIndex - 11);
+	pkt.contents.rcvd_cnts = component;
 
-	return totalRead;
+	return frameLen;
+}
+
+/*
+parse as much of the current frame header as has arrived, resuming where the last call stopped
+return 1 if the whole current frame is in the buffer
+return 0 if more bytes are needed
+return -1 if the bytes are not a frame of either format
+return -5 if the frame is longer than MAX_PACKET_LEN
+*/
+int parse_frame(struct connection *conn) {
+	int available = conn->rxEnd - conn->rxStart;
+	const char *frame = conn->rxBuffer + conn->rxStart;
+	static const char textPrefix[] = "content_len:";
+	const int prefixLength = sizeof(textPrefix) - 1;
+
+	if(conn->rxFrameLen == 0) {
+		if(available == 0)
+			return 0;
+		if((unsigned char) frame[0] == WIRE_MAGIC) {
+			if(available < WIRE_HEADER_LEN)
+				return 0;
+			conn->rxFrameLen = WIRE_HEADER_LEN + get_u32(frame + 4);
+		} else {
+			//"content_len:<digits>," then the length of the rest is fixed by the format
+			while(conn->rxScanned < prefixLength && conn->rxScanned < available) {
+				if(frame[conn->rxScanned] != textPrefix[conn->rxScanned]) {
+					fprintf(stderr, "Packet Format Wrong1\n");
+					return -1;
+				}
+				conn->rxScanned++;
+			}
+			while(conn->rxScanned < available && frame[conn->rxScanned] >= '0' && frame[conn->rxScanned] <= '9') {
+				if(conn->rxScanned - prefixLength >= 9) {
+					fprintf(stderr, "Packet Length Wrong\n");
+					return -5;
+				}
+				conn->rxContentLen = conn->rxContentLen * 10 + (frame[conn->rxScanned] - '0');
+				conn->rxScanned++;
+			}
+			if(conn->rxScanned == available)
+				return 0;
+			if(frame[conn->rxScanned] != ',' || conn->rxScanned == prefixLength) {
+				fprintf(stderr, "Packet Format Wrong1\n");
+				return -1;
+			}
+			conn->rxFrameLen = 98 + (conn->rxScanned - prefixLength) + conn->rxContentLen;
+		}
+		if(conn->rxFrameLen > MAX_PACKET_LEN) {
+			fprintf(stderr, "Packet Length Wrong\n");
+			return -5;
+		}
+	}
+	return available >= conn->rxFrameLen ? 1 : 0;
+}
+
+//acknowledge every windowed frame received so far with one cumulative ACK, the caller holds conn->rxLock
+static int ack_window(struct connection *conn, int socketfd) {
+	struct packet ackPkt;
+	ackPkt.content_len = 0;
+	ackPkt.cmd_code = ACK;
+	ackPkt.req_num = conn->rxCount;
+	ackPkt.sessionId = 0;
+
+	//windowed frames only come over binary, whatever this side writes with yet
+	int writeError = write_binary_helper(socketfd, ackPkt, WIRE_FLAG_CUMULATIVE);
+	if(writeError > 0)
+		conn->rxUnacked = 0;
+	else
+		fprintf(stderr, "Failed to Send ACK Packet\n");
+	return writeError;
+}
+
+/*
+return the next frame of the socket, reading only when the buffer holds no complete frame;
+bytes past the frame stay buffered for the next call. The caller holds conn->rxLock.
+windowed frames are acknowledged here, cumulatively, the caller acknowledges any other frame but an ACK.
+timeoutMs: -1 to block until a frame arrives
+return positive frame length if success, 0 if connection closed,
+-1 if format wrong, -2 if read() failed, -5 if length wrong, -9 if time out
+*/
+int receive_frame(struct connection *conn, int socketfd, struct packet &pkt, int timeoutMs) {
+	char errorMessage[ERR_LEN];
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	int parsed;
+
+	while((parsed = parse_frame(conn)) == 0) {
+		if(conn->rxEnd == RX_BUFFER_LEN) {
+			//only the start of one frame is left, move it to the front
+			memmove(conn->rxBuffer, conn->rxBuffer + conn->rxStart, conn->rxEnd - conn->rxStart);
+			conn->rxEnd -= conn->rxStart;
+			conn->rxStart = 0;
+		}
+		if(timeoutMs >= 0) {
+			struct pollfd pfd;
+			pfd.fd = socketfd;
+			pfd.events = POLLIN;
+			int ready = poll(&pfd, 1, remaining_ms(deadline));
+			if(ready == 0)
+				return -9;
+			if(ready < 0 && errno != EINTR) {
+				fprintf(stderr, "Error (poll): %s\n", strerror_r(errno, errorMessage, ERR_LEN));
+				return -2;
+			}
+			if(ready < 0)
+				continue;
+		}
+		int byteRead = read(socketfd, conn->rxBuffer + conn->rxEnd, RX_BUFFER_LEN - conn->rxEnd);
+		if(byteRead < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return -9;
+			fprintf(stderr, "Error (read): %s\n", strerror_r(errno, errorMessage, ERR_LEN));
+			return -2;
+		}
+		if(byteRead == 0)
+			return 0;
+		conn->rxEnd += byteRead;
+	}
+	if(parsed < 0)
+		return parsed;
+
+	const char *frame = conn->rxBuffer + conn->rxStart;
+	int frameLen = conn->rxFrameLen;
+	int ret;
+	if((unsigned char) frame[0] == WIRE_MAGIC) {
+		conn->rxFlags = (uint16_t)(((unsigned char) frame[2] << 8) | (unsigned char) frame[3]);
+		ret = read_binary_helper(frame, frameLen, pkt);
+	} else {
+		conn->rxFlags = 0;
+		ret = read_text_helper(frame, frameLen, pkt);
+	}
+
+	conn->rxStart += frameLen;
+	if(conn->rxStart == conn->rxEnd)
+		conn->rxStart = conn->rxEnd = 0;
+	conn->rxScanned = conn->rxFrameLen = 0;
+	conn->rxContentLen = 0;
+
+	if(ret > 0 && (conn->rxFlags & WIRE_FLAG_WINDOWED)) {
+		conn->rxCount++;
+		conn->rxUnacked++;
+	}
+	//acknowledge once everything that arrived is consumed, so a burst costs one ACK
+	if(conn->rxUnacked > 0 && (conn->rxStart == conn->rxEnd || conn->rxUnacked >= MAX_WINDOW / 2))
+		ack_window(conn, socketfd);
+	return ret;
+}
+
+/*
+wait for the socket to make progress: read one frame and route it if no other thread is reading,
+otherwise wait until the reader routes something or gives up the socket.
+The caller holds conn->bufLock and checks again for what it is waiting for.
+return 0 if success
+return -2 if the deadline passed or the read failed
+return -4 if the request queue is full
+*/
+static int pump_socket(struct connection *conn, int socketfd, chrono::steady_clock::time_point deadline) {
+	struct packet pkt;
+	int waitMs = remaining_ms(deadline);
+	if(waitMs == 0)
+		return -2;
+
+	if(conn->rxWaiting > 0 || conn->bufferedPkts.size() >= MAX_BUFFERED_PKTS || pthread_mutex_trylock(&conn->rxLock) != 0) {
+		//another thread is (about to be) reading this socket.
+		//a thread in read_socket goes first: it is the one that answers the requests we would only buffer.
+		//with the request queue full the rest stays in the socket, TCP holds back the peer until read_socket catches up
+		struct timespec until = realtime_after_ms(waitMs);
+		pthread_cond_timedwait(&conn->rxCond, &conn->bufLock, &until);
+		return 0;
+	}
+	pthread_mutex_unlock(&conn->bufLock);
+
+	int readError = receive_frame(conn, socketfd, pkt, waitMs);
+	bool pending = (readError > 0 && pkt.cmd_code != ACK) || conn->rxStart != conn->rxEnd;
+	if(readError > 0)	//route while still holding the socket, so a thread entering read_socket is sure to see a buffered request
+		readError = route_frame(conn, pkt, readError);
+	else
+		readError = -2;
+	release_reader(conn, socketfd, pending);	//the socket will not become readable for what we took out of it
+	pthread_mutex_lock(&conn->bufLock);
+	return readError;
 }
 
 void deepCopyPkt(struct packet &destination, struct packet &source) {
@@ -343,9 +1001,67 @@ void deepCopyPkt(struct packet &destination, struct packet &source) {
 		destination.contents.rcvd_cnts = string();
 }
 
+/*
+write a frame that counts against the window of the socket, waiting only while the window is full;
+its ACK comes later with the cumulative ACK of the frames before it, see flush_socket
+*/
+static int write_windowed(struct connection *conn, int socketfd, struct packet &pkt) {
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(TIMEOUT_SEC);
+	char pktString[MAX_PACKET_LEN];
+	int writeError = 0;
+	int frameLen = encode_binary(pktString, pkt, WIRE_FLAG_WINDOWED);
+	if(frameLen < 0)
+		return -1;
+
+	pthread_mutex_lock(&conn->bufLock);
+	while(1) {
+		while(conn->txSent - conn->txAcked >= conn->window && (writeError = pump_socket(conn, socketfd, deadline)) == 0);
+		if(writeError < 0) {
+			pthread_mutex_unlock(&conn->bufLock);
+			fprintf(stderr, "Failed to Read ACK Packet\n");
+			return writeError == -4 ? -4 : -2;
+		}
+		//frames have to go out in the order they are counted, take txLock before bufLock
+		pthread_mutex_unlock(&conn->bufLock);
+		pthread_mutex_lock(&conn->txLock);
+		pthread_mutex_lock(&conn->bufLock);
+		if(conn->txSent - conn->txAcked < conn->window)
+			break;
+		pthread_mutex_unlock(&conn->txLock);	//another writer took the room
+	}
+	conn->txSent++;
+	pthread_mutex_unlock(&conn->bufLock);
+	writeError = send_frame(socketfd, pktString, frameLen);
+	pthread_mutex_unlock(&conn->txLock);
+	if(writeError < 0)
+		return writeError;
+
+	packet_log_write(log_connection(conn, socketfd), writeError, pkt, "windowed");
+	return 0;
+}
+
+int flush_socket(int socketfd) {
+	struct connection *conn = get_connection(socketfd);
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(TIMEOUT_SEC);
+	int pumpError = 0;
+	if(conn == NULL)
+		return -2;
+
+	pthread_mutex_lock(&conn->bufLock);
+	while((int)(conn->txSent - conn->txAcked) > 0 && (pumpError = pump_socket(conn, socketfd, deadline)) == 0);
+	pthread_mutex_unlock(&conn->bufLock);
+	if(pumpError < 0) {
+		fprintf(stderr, "Failed to Read ACK Packet\n");
+		return pumpError == -4 ? -4 : -2;
+	}
+	return 0;
+}
+
 int write_socket(int socketfd, struct packet &pkt) {
-	int readError = 0;
-	bool doTCPRead = true;
+	int pumpError = 0;
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return -1;
 
 	if((isServer && pkt.cmd_code == NOTIFY) || (!isServer && pkt.cmd_code != ACK && pkt.cmd_code != NOTIFY)) {	//if the packet is a new request, assign a req-num to it
 		pthread_mutex_lock(&seqNumlock);
@@ -354,164 +1070,144 @@ int write_socket(int socketfd, struct packet &pkt) {
 		pthread_mutex_unlock(&seqNumlock);
 	}
 
+	//the wire state as one, wire_apply and reset_connection change it under bufLock
+	pthread_mutex_lock(&conn->bufLock);
+	enum wireModes mode = conn->wireMode;
+	unsigned int window = conn->window;
+	bool implicitAck = conn->implicitAck;
+	pthread_mutex_unlock(&conn->bufLock);
+
 	//calculate the correct contentLength
-	int contentLength = to_string(pkt.cmd_code).length() + to_string(pkt.req_num).length() + to_string(pkt.sessionId).length() + pkt.contents.username.length() + pkt.contents.password.length() + pkt.contents.postee.length() + pkt.contents.post.length() + pkt.contents.wallOwner.length() + pkt.contents.rcvd_cnts.length();
-	pkt.content_len = (unsigned int) contentLength;
+	pkt.content_len = wire_content_len(pkt, mode);
+
+	if(implicitAck && pkt.cmd_code != ACK && pkt.cmd_code != NOTIFY) {
+		//a request is acknowledged by its response, a response by TCP delivering it
+		int writeError = write_binary_helper(socketfd, pkt, WIRE_FLAG_IMPLICIT);
+		if(writeError < 0)
+			return writeError;
+		packet_log_write(log_connection(conn, socketfd), writeError, pkt, "implicit");
+		return 0;
+	}
+	if(window > 0 && pkt.cmd_code != ACK)
+		return write_windowed(conn, socketfd, pkt);
+
+	//register before writing, the ACK may be read by another thread as soon as the frame is out
+	uint64_t key = ack_key(pkt.req_num, pkt.content_len);
+	pthread_mutex_lock(&conn->bufLock);
+	conn->pendingAcks[key] = {false, 0};
+	pthread_mutex_unlock(&conn->bufLock);
 
 	int writeError = write_socket_helper(socketfd, pkt);
-	if(writeError < 0)
+	if(writeError < 0) {
+		pthread_mutex_lock(&conn->bufLock);
+		conn->pendingAcks.erase(key);
+		pthread_mutex_unlock(&conn->bufLock);
 		return writeError;
+	}
 
 	auto sendTime = chrono::high_resolution_clock::now();
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(TIMEOUT_SEC);
+	unsigned int ackSessionId = 0;
 
-	struct packet ackPkt;
-
-
-	Retry:
-	pthread_mutex_lock(&bufferPktlock);
-	//if there are buffer pkts, check each, see if the wanted ACK is in them
-	if(bufferOccupied > 0) {
-		for(int i = 0; i < bufferOccupied; i++) {
-			deepCopyPkt(ackPkt, bufferPkts[i]);
-			if(ackPkt.content_len != pkt.content_len || ackPkt.cmd_code != ACK || ackPkt.req_num != pkt.req_num || ackPkt.sessionId != pkt.sessionId) {
-				continue;	//not the wanted one
-			} else {	//got the wanted one
-				bufferOccupied--;
-				for(int j = i; j < bufferOccupied; j++) {
-					deepCopyPkt(bufferPkts[j], bufferPkts[j+1]);
-				}
-				doTCPRead = false;
-				string contentLengthString = to_string(pkt.content_len);
-				int packetLength = 98 + contentLengthString.length() + stoi(contentLengthString);
-				readError = packetLength;	//if get packet from buffer, change readError to packet length
-			}
+	pthread_mutex_lock(&conn->bufLock);
+	while(1) {
+		auto slot = conn->pendingAcks.find(key);
+		if(slot == conn->pendingAcks.end()) {	//connection was reset
+			pumpError = -2;
+			break;
 		}
-	}
-	pthread_mutex_unlock(&bufferPktlock);
-
-	if(doTCPRead) {
-		//set timeout, the read for ACK needs to timeout
-		struct timeval tv;
-		tv.tv_sec = TIMEOUT_SEC;
-		tv.tv_usec = 0;
-		if(setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0) {
-			char errorMessage[ERR_LEN];
-			fprintf(stderr, "setsockopt(TIMEOUT) failed; Error Message: %s\n", strerror_r(errno, errorMessage, ERR_LEN));
-			return -5;
+		if(slot->second.received) {
+			ackSessionId = slot->second.sessionId;
+			conn->pendingAcks.erase(slot);
+			break;
 		}
-		readError = read_socket_helper(socketfd, ackPkt);
-		if(readError <= 0) {
-			doTCPRead = false;
-			goto Retry;
+		pumpError = pump_socket(conn, socketfd, deadline);
+		if(pumpError < 0) {
+			conn->pendingAcks.erase(key);
+			break;
 		}
 	}
-	if(readError <= 0) {
+	pthread_mutex_unlock(&conn->bufLock);
+	if(pumpError == -4)
+		return -4;
+	if(pumpError < 0) {
 		fprintf(stderr, "Failed to Read ACK Packet\n");
 		return -2;
 	}
 
-	pthread_mutex_lock(&bufferPktlock);
-	if(ackPkt.cmd_code != ACK || ackPkt.req_num != pkt.req_num) {	//get unwanted packet, put it into buffer
-		if(bufferOccupied > 9) {
-			fprintf(stderr, "Buffer Queue Full\n");
-			pthread_mutex_unlock(&bufferPktlock);
-			return -4;
-		} else {
-			deepCopyPkt(bufferPkts[bufferOccupied], ackPkt);
-			bufferOccupied++;
-			pthread_mutex_unlock(&bufferPktlock);
-			goto Retry;
-		}
-	}
-
-	pthread_mutex_unlock(&bufferPktlock);
-
-	if(ackPkt.sessionId != pkt.sessionId) {
+	if(ackSessionId != pkt.sessionId) {
 		fprintf(stderr, "ACK Packet belong to other session\n");
 		return -3;
 	}
-	if(ackPkt.content_len != pkt.content_len) {
-		fprintf(stderr, "ACK Packet does not match\n");
-		return -5;
-	}
 
 	Skip:
-	pthread_mutex_lock(&logFilelock);
-	FILE * logFile;
-	logFile = fopen("log.txt","a");
-	auto endTime = chrono::high_resolution_clock::now();
-	std::chrono::duration<double> response_time = endTime - sendTime;
-	std::time_t endTimeStamp = std::chrono::system_clock::to_time_t(endTime);
-	std::time_t sendTimeStamp = std::chrono::system_clock::to_time_t(sendTime);
-	fprintf(logFile, "Write %d byte at %s\t[len: %u | cmd: %s | num: %u | sid: %u]\n", writeError, std::ctime(&sendTimeStamp), pkt.content_len, getCommand(pkt.cmd_code), pkt.req_num, pkt.sessionId);
-	fprintf(logFile, "Received ACK packet at %sResponse time: %f ms\n\n", std::ctime(&endTimeStamp), response_time.count()*1000);
-	fclose(logFile);
-	pthread_mutex_unlock(&logFilelock);
+	std::chrono::duration<double> response_time = chrono::high_resolution_clock::now() - sendTime;
+	packet_log_acked(log_connection(conn, socketfd), writeError, pkt, response_time.count()*1000);
+	if(ackHandler != NULL)
+		ackHandler(pkt, response_time.count()*1000);
 	return 0;
 }
 
-int read_socket(int socketfd, struct packet &pkt) {
-	//turn off timeout if any
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	if(setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0) {
-		char errorMessage[ERR_LEN];
-		fprintf(stderr, "setsockopt(TIMEOUT) failed; Error Message: %s\n", strerror_r(errno, errorMessage, ERR_LEN));
-		return -5;
-	}
+//read_socket and read_socket_nowait, wait: wait for the reader of the socket instead of returning -9
+static int read_socket_helper(int socketfd, struct packet &pkt, bool wait) {
+	struct connection *conn = get_connection(socketfd);
+	struct packet ackPkt;
+	int readError = 0;
+	bool acknowledged;
+	if(conn == NULL)
+		return -2;
 
-	pthread_mutex_lock(&bufferPktlock);
-	if(bufferOccupied > 0) {
-		for(int i = 0; i < bufferOccupied; i++) {
-			deepCopyPkt(pkt, bufferPkts[i]);
-			if(pkt.cmd_code != ACK) {
-				bufferOccupied--;
-				for(int j = i; j < bufferOccupied; j++) {
-					deepCopyPkt(bufferPkts[j], bufferPkts[j+1]);
-				}
-				string contentLengthString = to_string(pkt.content_len);
-				int packetLength = 98 + contentLengthString.length() + stoi(contentLengthString);
-				pthread_mutex_unlock(&bufferPktlock);
-				return packetLength;
-			}
+	//take a buffered request, or become the reader of the socket. Wait for either without blocking on rxLock:
+	//its holder may be waiting for an ACK that the peer only sends once we acknowledge a request it buffered
+	pthread_mutex_lock(&conn->bufLock);
+	conn->rxWaiting++;
+	while(conn->bufferedPkts.empty() && pthread_mutex_trylock(&conn->rxLock) != 0) {
+		if(!wait) {
+			conn->rxWaiting--;
+			conn->rxDeferred = true;
+			pthread_mutex_unlock(&conn->bufLock);
+			return -9;
 		}
+		pthread_cond_wait(&conn->rxCond, &conn->bufLock);
 	}
-	pthread_mutex_unlock(&bufferPktlock);
+	conn->rxWaiting--;
+	if(!conn->bufferedPkts.empty()) {
+		struct bufferedPkt &front = conn->bufferedPkts.front();
+		deepCopyPkt(pkt, front.pkt);
+		readError = front.frameLen;
+		acknowledged = front.flags & (WIRE_FLAG_WINDOWED | WIRE_FLAG_IMPLICIT);
+		conn->bufferedPkts.pop_front();
+		pthread_cond_broadcast(&conn->rxCond);	//room in the queue for a writer waiting to read
+		pthread_mutex_unlock(&conn->bufLock);
+		goto Acknowledge;	//buffered by a thread waiting for its ACK, it is still ours to acknowledge
+	}
+	pthread_mutex_unlock(&conn->bufLock);
 
 	Retry:
-	int readError = read_socket_helper(socketfd, pkt);
-	if(readError <= 0)	//error in reading
+	readError = receive_frame(conn, socketfd, pkt, -1);
+	if(readError <= 0) {	//error in reading
+		release_reader(conn, socketfd, false);
 		return readError;
+	}
 
-	if(pkt.cmd_code == ACK) {
-		pthread_mutex_lock(&bufferPktlock);
-		if(bufferOccupied < 10) {
-				deepCopyPkt(bufferPkts[bufferOccupied], pkt);
-				bufferOccupied++;
-				pthread_mutex_unlock(&bufferPktlock);
-				goto Retry;
-		} else {
-			fprintf(stderr, "Recieved a ACK Packet, buffer Packet Queue Full\n");
-		}
-		pthread_mutex_unlock(&bufferPktlock);
-		return -4;
+	if(pkt.cmd_code == ACK) {	//belongs to a thread waiting in write_socket
+		route_frame(conn, pkt, readError);
+		goto Retry;
 	}
 
-	struct packet ackPkt;
-	deepCopyPkt(ackPkt, pkt);
-	ackPkt.cmd_code = ACK;
+	acknowledged = conn->rxFlags & (WIRE_FLAG_WINDOWED | WIRE_FLAG_IMPLICIT);
+	release_reader(conn, socketfd, false);
 
-	int writeError = write_socket_helper(socketfd, ackPkt);
+	Acknowledge:
+
+	int writeError = 1;
+	if(!acknowledged) {	//receive_frame has acknowledged a windowed frame already, an implicit one needs none
+		deepCopyPkt(ackPkt, pkt);
+		ackPkt.cmd_code = ACK;
+		writeError = write_socket_helper(socketfd, ackPkt);
+	}
 	if(writeError > 0) {
-		pthread_mutex_lock(&logFilelock);
-		FILE * logFile;
-		logFile = fopen("log.txt","a");
-    		time_t timeStamp;
-    		timeStamp = time(NULL);
-    		fprintf(logFile, "Read %d byte at %s\t[len: %u | cmd: %s | num: %u | sid: %u]\n\n", readError, asctime(localtime(&timeStamp)),  pkt.content_len, getCommand(pkt.cmd_code), pkt.req_num, pkt.sessionId);
-		fclose(logFile);
-		pthread_mutex_unlock(&logFilelock);
+		packet_log_read(log_connection(conn, socketfd), readError, pkt);
 		return readError;
 	} else {
 		fprintf(stderr, "Failed to Send ACK Packet\n");
@@ -520,3 +1216,190 @@ int read_socket(int socketfd, struct packet &pkt) {
 
 	return 0;
 }
+
+int read_socket(int socketfd, struct packet &pkt) {
+	return read_socket_helper(socketfd, pkt, true);
+}
+
+int read_socket_nowait(int socketfd, struct packet &pkt) {
+	return read_socket_helper(socketfd, pkt, false);
+}
+
+void set_queue_policy(enum queuePolicies policy, unsigned int maxQueued) {
+	queuePolicy = policy;
+	maxQueuedPkts = maxQueued > 0 ? maxQueued : 1;
+}
+
+void set_delivered_handler(void (*handler)(int socketfd, uint64_t tag, int result)) {
+	deliveredHandler = handler;
+}
+
+void set_ack_handler(void (*handler)(struct packet &pkt, double response_ms)) {
+	ackHandler = handler;
+}
+
+static void report_delivered(int socketfd, deque<struct outboundPkt> &pkts) {
+	for(struct outboundPkt &out : pkts) {
+		if(deliveredHandler != NULL)
+			deliveredHandler(socketfd, out.tag, out.result);
+	}
+	pkts.clear();
+}
+
+//hand a socket with queued packets to the drain threads, it waits behind the sockets queued before it
+static void schedule_drain(int socketfd) {
+	pthread_mutex_lock(&drainLock);
+	drainReady.push_back(socketfd);
+	pthread_cond_signal(&drainCond);
+	pthread_mutex_unlock(&drainLock);
+}
+
+//write one window of the queued packets of a socket, then put the socket back in line if more are queued
+static void drain_window(int socketfd) {
+	struct connection *conn = get_connection(socketfd);
+	deque<struct outboundPkt> batch;
+	deque<struct outboundPkt> dropped;
+	int writeError = 0;
+	bool more;
+
+	pthread_mutex_lock(&conn->queueLock);
+	dropped.swap(conn->txDropped);
+	while(!conn->txQueue.empty() && batch.size() < MAX_WINDOW) {
+		batch.push_back(conn->txQueue.front());
+		conn->txQueue.pop_front();
+	}
+	pthread_mutex_unlock(&conn->queueLock);
+	report_delivered(socketfd, dropped);
+
+	if(!batch.empty()) {
+		for(struct outboundPkt &out : batch) {
+			if((writeError = write_socket(socketfd, out.pkt)) < 0)
+				break;
+		}
+		if(writeError == 0)	//a windowed socket has only written them, wait for the peer
+			writeError = flush_socket(socketfd);
+		for(struct outboundPkt &out : batch)
+			out.result = writeError < 0 ? -2 : 0;
+	}
+
+	pthread_mutex_lock(&conn->queueLock);
+	if(writeError < 0) {
+		//later packets must not arrive without this batch, fail the rest of the queue as well
+		fprintf(stderr, "Failed to Write Queued Packet\n");
+		while(!conn->txQueue.empty()) {
+			conn->txQueue.front().result = -2;
+			batch.push_back(conn->txQueue.front());
+			conn->txQueue.pop_front();
+		}
+	}
+	pthread_mutex_unlock(&conn->queueLock);
+	report_delivered(socketfd, batch);	//before an enqueue can schedule the socket again, so reports stay in order
+
+	pthread_mutex_lock(&conn->queueLock);
+	more = !conn->txQueue.empty() || !conn->txDropped.empty();
+	if(!more)
+		conn->txDraining = false;
+	pthread_mutex_unlock(&conn->queueLock);
+	if(more)
+		schedule_drain(socketfd);
+}
+
+//take sockets in turn from the ready list, a window each, so one slow peer holds up a single drain thread at most
+static void *drain_worker(void *) {
+	int socketfd;
+
+	while(1) {
+		pthread_mutex_lock(&drainLock);
+		while(drainReady.empty())
+			pthread_cond_wait(&drainCond, &drainLock);
+		socketfd = drainReady.front();
+		drainReady.pop_front();
+		pthread_mutex_unlock(&drainLock);
+		drain_window(socketfd);
+	}
+	return NULL;
+}
+
+static void start_drain_threads() {
+	pthread_t drainer;
+	pthread_attr_t attr;
+	char errorMessage[ERR_LEN];
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(int i = 0; i < DRAIN_THREADS; i++) {
+		if((ret = pthread_create(&drainer, &attr, drain_worker, NULL)) != 0) {
+			fprintf(stderr, "Error (pthread_create): %s\n", strerror_r(ret, errorMessage, ERR_LEN));
+			continue;
+		}
+		drainThreads++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+//append the rcvd_cnts of pkt to the last queued packet if the result still fits in a frame
+static bool coalesce_last(struct connection *conn, struct packet &pkt, uint64_t tag) {
+	if(conn->txQueue.empty())
+		return false;
+	struct outboundPkt &last = conn->txQueue.back();
+	if(last.pkt.cmd_code != NOTIFY || pkt.cmd_code != NOTIFY || last.pkt.sessionId != pkt.sessionId)
+		return false;
+	if(last.pkt.contents.rcvd_cnts.length() + 1 + pkt.contents.rcvd_cnts.length() > MAX_COALESCED_LEN)
+		return false;
+	last.pkt.contents.rcvd_cnts += "\n" + pkt.contents.rcvd_cnts;
+	last.tag = tag;	//delivering the merged packet delivers both
+	return true;
+}
+
+int enqueue_socket(int socketfd, struct packet &pkt, uint64_t tag) {
+	struct connection *conn = get_connection(socketfd);
+	if(conn == NULL)
+		return -1;
+
+	pthread_once(&drainOnce, start_drain_threads);
+	pthread_mutex_lock(&conn->queueLock);
+	if(drainThreads == 0) {
+		//nothing will ever write the queue, fail what it holds so no delivery waits forever
+		deque<struct outboundPkt> failed;
+		failed.swap(conn->txDropped);
+		while(!conn->txQueue.empty()) {
+			conn->txQueue.front().result = -2;
+			failed.push_back(conn->txQueue.front());
+			conn->txQueue.pop_front();
+		}
+		pthread_mutex_unlock(&conn->queueLock);
+		report_delivered(socketfd, failed);
+		return -1;
+	}
+	if(conn->txShutdown) {
+		pthread_mutex_unlock(&conn->queueLock);
+		return -4;
+	}
+	if(conn->txQueue.size() >= maxQueuedPkts) {
+		if(queuePolicy == QUEUE_DISCONNECT) {
+			conn->txShutdown = true;
+			pthread_mutex_unlock(&conn->queueLock);
+			fprintf(stderr, "Queue Full, Disconnecting Slow Peer\n");
+			shutdown(socketfd, SHUT_RDWR);	//its reader closes the socket, a drain thread fails the rest
+			return -4;
+		}
+		if(queuePolicy == QUEUE_COALESCE && coalesce_last(conn, pkt, tag)) {
+			pthread_mutex_unlock(&conn->queueLock);
+			return 0;
+		}
+		//drop the oldest, reported by a drain thread as the socket is in line with a full queue
+		conn->txQueue.front().result = -4;
+		conn->txDropped.push_back(conn->txQueue.front());
+		conn->txQueue.pop_front();
+	}
+	conn->txQueue.push_back({pkt, tag, 0});
+	if(conn->txDraining) {
+		pthread_mutex_unlock(&conn->queueLock);
+		return 0;
+	}
+	conn->txDraining = true;
+	pthread_mutex_unlock(&conn->queueLock);
+	schedule_drain(socketfd);
+	return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef PACKET_LOG_H_
+#define PACKET_LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include "structures.h"
+#include "packet_trace.h"
+
+#define PACKET_LOG_FILE "log.txt"
+#define PACKET_LOG_RING 1024	//records a thread can have waiting for the log writer, more are dropped
+#define PACKET_LOG_INTERVAL_MS 100	//how often the log writer empties the rings
+
+/*
+packets are logged without blocking the thread reading or writing them: each thread puts fixed size records
+in a ring of its own, a log writer thread empties the rings into PACKET_LOG_FILE (opened once) and formats them;
+a record that does not fit in the ring of its thread is dropped and counted in the log;
+with a trace file set, the records go to it as packetTraceRecords instead, see packet_trace.h
+*/
+enum packetLogLevels {
+	PACKET_LOG_OFF,	//nothing is logged
+	PACKET_LOG_ACKED,	//writes that waited for their ACK, with the response time
+	PACKET_LOG_ALL	//also reads and writes whose ACK is not waited for
+};
+
+/*
+log the records up to level, and only one packet in every sample a thread logs (1 logs every packet)
+*/
+void packet_log_config(enum packetLogLevels level, unsigned int sample);
+
+/*
+write the records to a binary trace at path instead of PACKET_LOG_FILE, call before any packet is logged
+return 0 if the trace file is created and mapped
+return -1 if not, packets are still logged to PACKET_LOG_FILE
+*/
+int packet_log_trace(const char *path);
+
+/*
+log a packet read from a socket, bytes is the length of its frame; connection tells the sockets apart
+in a trace, see packetTraceRecord
+*/
+void packet_log_read(uint32_t connection, int bytes, struct packet &pkt);
+
+/*
+log a packet written to a socket whose ACK is not waited for, mode tells why ("windowed" or "implicit")
+*/
+void packet_log_write(uint32_t connection, int bytes, struct packet &pkt, const char *mode);
+
+/*
+log a packet written to a socket once its ACK was received, response_ms after it was written
+*/
+void packet_log_acked(uint32_t connection, int bytes, struct packet &pkt, double response_ms);
+
+/*
+write every record logged so far to the file, called by the log writer and at exit
+*/
+void packet_log_flush();
+
+#endif /* PACKET_LOG_H_ */
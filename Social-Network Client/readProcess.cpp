@@ -17,19 +17,29 @@
 
 extern string username;
 extern unsigned int sessionID;
+extern string wallShown;
+extern unsigned int wallNext;
+extern unordered_map<unsigned int, struct wallRequest> wallRequests;
+extern unsigned int wallLatest;
+extern string wallVersion;
+extern string listVersion;
+extern pthread_mutex_t viewLock;
 
 using namespace std;
 
 void readThread(int sock_fd);
-int sendPacket(int sock_fd, enum commands cmd_code, string key, string value);
+int sendPacket(int sock_fd, enum commands cmd_code, string key, string value, unsigned int *req_num);
 void printCmdList();
 void list(int sock_fd);
 void post(int sock_fd);
 void show(int sock_fd);
+void showOlder(int sock_fd);
+void sendShow(int sock_fd, string name, string page, bool newest);
 void logout(int sock_fd);
 void createLoginPacket(string username, string pw, struct packet &pkt);
 void createPostPacket(string postee, string post, struct packet &pkt);
-void createShowPacket(string wallOwner, struct packet &pkt);
+void createShowPacket(string wallOwner, string page, struct packet &pkt);
+void createListPacket(string version, struct packet &pkt);
 
 
 /*
@@ -67,6 +77,10 @@ void readThread(int sock_fd)
         {
         	logout(sock_fd);
         }
+        else if (strcmp(input.c_str(), "5") == 0)
+        {
+        	showOlder(sock_fd);
+        }
         else
         {
             cout<<"Invalid Option. Try again !!!\n";
@@ -80,11 +94,12 @@ void readThread(int sock_fd)
  */
 void printCmdList()
 {
-    cout<<"Commands (Enter 0- 4)\n"<<"--------------\n";
+    cout<<"Commands (Enter 0- 5)\n"<<"--------------\n";
     cout<<"1. List all users\n";
     cout<<"2. Post to wall\n";
     cout<<"3. Show wall\n";
     cout<<"4. Logout\n";
+    cout<<"5. Show older posts of the last wall\n";
     cout<<"[Enter 0 to print the command list]\n\n";
     return;
 }
@@ -95,7 +110,13 @@ void printCmdList()
  */
 void list(int sock_fd)
 {
-    sendPacket(sock_fd, LIST, "", "");
+    string version;
+
+    /* the server answers UNCHANGED if the list shown last is still current */
+    pthread_mutex_lock(&viewLock);
+    version = listVersion;
+    pthread_mutex_unlock(&viewLock);
+    sendPacket(sock_fd, LIST, version, "");
     return;
 }
 
@@ -162,7 +183,51 @@ void show(int sock_fd)
 		cout<<"Invalid Option\n";
 		return;
 	}
-	sendPacket(sock_fd, SHOW, name, "");
+	/* newest posts first, a page at a time, UNCHANGED if the newest page shown last is still current */
+	pthread_mutex_lock(&viewLock);
+	if (name != wallShown)
+		wallVersion.clear();
+	wallShown = name;
+	wallNext = 0;
+	sendShow(sock_fd, name, wall_page_request(0, WALL_PAGE_LIMIT, wallVersion), true);
+	pthread_mutex_unlock(&viewLock);
+    return;
+}
+
+/*
+ * showOlder() - send a request for the next page of the last wall shown
+ * sock_fd: socket file descriptor
+ */
+void showOlder(int sock_fd)
+{
+	pthread_mutex_lock(&viewLock);
+	if (wallNext == 0)
+	{
+		pthread_mutex_unlock(&viewLock);
+		cout<<"No older posts\n";
+		return;
+	}
+	sendShow(sock_fd, wallShown, wall_page_request(wallNext, WALL_PAGE_LIMIT), false);
+	pthread_mutex_unlock(&viewLock);
+    return;
+}
+
+/*
+ * sendShow() - send a SHOW request and remember what it asked for, called under viewLock
+ * holding viewLock until the request is numbered keeps the socket thread from handling its response first
+ * sock_fd: socket file descriptor
+ * name: wall owner
+ * page: page of the wall to show (wall_page_request)
+ * newest: page is the newest page of the wall
+ */
+void sendShow(int sock_fd, string name, string page, bool newest)
+{
+	unsigned int req_num;
+
+	if (sendPacket(sock_fd, SHOW, name, page, &req_num) < 0)
+		return;
+	wallRequests[req_num] = {name, newest};
+	wallLatest = req_num;
     return;
 }
 
@@ -180,9 +245,10 @@ void logout(int sock_fd)
  * sock_fd: socket file descriptor
  * cmd_code: command code
  * value1 & value2: depending on the command
+ * req_num: set to the req_num the request was sent with, if not NULL
  * return 0 (success) -1(error)
  */
-int sendPacket(int sock_fd, enum commands cmd_code, string value1, string value2)
+int sendPacket(int sock_fd, enum commands cmd_code, string value1, string value2, unsigned int *req_num)
 {
     struct packet req;
     int send_bytes;
@@ -197,12 +263,13 @@ int sendPacket(int sock_fd, enum commands cmd_code, string value1, string value2
     case LOGOUT:
     	break;
     case LIST:
+    	createListPacket(value1, req);
     	break;
     case POST:
     	createPostPacket(value1, value2, req);
     	break;
     case SHOW:
-    	createShowPacket(value1, req);
+    	createShowPacket(value1, value2, req);
     	break;
     default:
     	printf("Invalid Command Code\n");
@@ -215,6 +282,8 @@ int sendPacket(int sock_fd, enum commands cmd_code, string value1, string value2
     	printf("Error (write_socket)\n");
         return -1;
     }
+    if (req_num != NULL)
+    	*req_num = req.req_num;
     return 0;
 }
 
@@ -228,6 +297,7 @@ void createLoginPacket(string username, string pw, struct packet &pkt)
 {
 	pkt.contents.username = username;
 	pkt.contents.password = pw;
+	pkt.contents.rcvd_cnts = wire_offer();
 }
 
 /*
@@ -242,14 +312,26 @@ void createPostPacket(string postee, string post, struct packet &pkt)
 	pkt.contents.post = post;
 }
 
+/*
+ * createListPacket() - create list packet
+ * version: version of the list shown last, empty if none
+ * pkt: request packet where the details are stored
+ */
+void createListPacket(string version, struct packet &pkt)
+{
+	pkt.contents.rcvd_cnts = list_request(version);
+}
+
 /*
  * createShowPacket() - create show packet
  * wallOwner: username of wall owner
+ * page: page of the wall to show (wall_page_request)
  * pkt: request packet where the details are stored
  */
-void createShowPacket(string wallOwner, struct packet &pkt)
+void createShowPacket(string wallOwner, string page, struct packet &pkt)
 {
 	pkt.contents.wallOwner = wallOwner;
+	pkt.contents.rcvd_cnts = page;
 }
 
 
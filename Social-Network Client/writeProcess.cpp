@@ -18,13 +18,25 @@
 
 extern const char * getCommand(int enumVal);
 extern unsigned int sessionID;
+extern string wallShown;
+extern unsigned int wallNext;
+extern unordered_map<unsigned int, struct wallRequest> wallRequests;
+extern unsigned int wallLatest;
+extern string wallVersion;
+extern string wallPage;
+extern unsigned int wallPageNext;
+extern string listVersion;
+extern string listShown;
+extern pthread_mutex_t viewLock;
 
 using namespace std;
 
 void writeThread(int sock_fd);
 int parsePacket(struct packet *req);
 void displayContents(struct packet *resp);
+void displayView(struct packet *resp);
 int processResponse(int sock_fd, struct packet *resp);
+bool isLoginAccepted(struct packet *resp);
 
 /*
  * writeThread() - thread to write to stdout
@@ -108,12 +120,16 @@ int parsePacket(struct packet *resp)
 int processResponse(int sock_fd, struct packet *resp)
 {
 
-	if(resp->cmd_code == LIST || resp->cmd_code == SHOW || resp->cmd_code == POST || resp->cmd_code == NOTIFY || resp->cmd_code == LOGOUT)
+	if (resp->cmd_code == LIST || resp->cmd_code == SHOW)
+		displayView(resp);
+	else if(resp->cmd_code == POST || resp->cmd_code == NOTIFY || resp->cmd_code == LOGOUT)
 		displayContents(resp);
 	else if (resp->cmd_code == LOGIN)
-		if (!resp->contents.rcvd_cnts.length())
+		if (isLoginAccepted(resp))
 		{
 			sessionID = resp->sessionId;
+			/* switch to the wire capabilities the server accepted, if any */
+			wire_apply(sock_fd, resp->contents.rcvd_cnts);
 		}
 		else
 		{
@@ -130,6 +146,80 @@ int processResponse(int sock_fd, struct packet *resp)
 	return 0;
 }
 
+/*
+ * displayView() - display a LIST or SHOW response, from what was shown before if it is UNCHANGED
+ * resp: response from server
+ */
+void displayView(struct packet *resp)
+{
+	string version;
+	unsigned int next;
+	unordered_map<unsigned int, struct wallRequest>::iterator asked;
+
+	pthread_mutex_lock(&viewLock);
+	if (resp->cmd_code == LIST && is_unchanged(resp->contents.rcvd_cnts))
+	{
+		resp->contents.rcvd_cnts = listShown;
+		displayContents(resp);
+	}
+	else if (resp->cmd_code == LIST && list_split(resp->contents.rcvd_cnts, &version) == 0)
+	{
+		listVersion = version;
+		listShown = resp->contents.rcvd_cnts;
+		displayContents(resp);
+	}
+	else if (resp->cmd_code == SHOW && (asked = wallRequests.find(resp->req_num)) != wallRequests.end())
+	{
+		/* the response answers the request with its req_num, the last SHOW sent may be a later one */
+		struct wallRequest request = asked->second;
+		wallRequests.erase(asked);
+		if (is_unchanged(resp->contents.rcvd_cnts))
+		{
+			resp->contents.rcvd_cnts = wallPage;
+			next = wallPageNext;
+		}
+		else if (wall_page_split(resp->contents.rcvd_cnts, &next, &version) == 0)
+		{
+			if (request.newest && request.wall == wallShown)
+			{
+				wallVersion = version;
+				wallPage = resp->contents.rcvd_cnts;
+				wallPageNext = next;
+			}
+		}
+		else
+			next = 0;	/* an error message */
+		displayContents(resp);
+		if (resp->req_num == wallLatest)
+		{
+			wallNext = next;
+			if (wallNext != 0)
+				printf("[Enter 5 for older posts]\n");
+		}
+	}
+	else
+		displayContents(resp);
+	pthread_mutex_unlock(&viewLock);
+	return;
+}
+
+/*
+ * isLoginAccepted() - check whether a LOGIN response reports success
+ * resp: response from server
+ * an old server echoes our capability offer back, a new one answers with what it accepted
+ * return true(logged in) false(rcvd_cnts holds an error message)
+ */
+bool isLoginAccepted(struct packet *resp)
+{
+	string &cnts = resp->contents.rcvd_cnts;
+
+	if (!cnts.length())
+		return true;
+	if (cnts.compare(0, strlen(WIRE_OFFER), WIRE_OFFER) == 0 || cnts.compare(0, strlen(WIRE_ACCEPT), WIRE_ACCEPT) == 0)
+		return true;
+	return false;
+}
+
 /*
  * displayContents() - display the contents of the response packet
  * resp: response from server
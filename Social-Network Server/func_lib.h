@@ -27,20 +27,34 @@ using namespace std;
 
 /* processClient.cpp */
 void handleClient(int sock_fd);
+int serveRequest(int sock_fd, struct packet &req, chrono::steady_clock::time_point received);
+int clientClosed(int sock_fd);
 int readRequest(int sock_fd, char *buffer, int req_len);
 int parsePacket(struct packet *req);
 int sessionValidity(struct packet *req);
 
 /* processRequests.cpp */
 int processRequest(int sock_fd, struct packet &req);
-void userLogin(int sock_fd, struct packet &req);
-void userLogout(int sock_fd, struct packet &req);
-void listAllUsers(int sock_fd, struct packet &req);
-void postMessage(int sock_fd, struct packet &req);
-void showWallMessage(int sock_fd, struct packet &req);
+int userLogin(int sock_fd, struct packet &req);
+int userLogout(int sock_fd, struct packet &req);
+int listAllUsers(int sock_fd, struct packet &req);
+int postMessage(int sock_fd, struct packet &req);
+int showWallMessage(int sock_fd, struct packet &req);
 int sendPacket(int sock_fd, struct packet &resp);
 
 /* processNotifications.cpp */
-void processNotification();
+int startNotifications(int count);
+void wakeNotifications();
+
+/* processEvents.cpp */
+int startEventLoops(int count);
+int addClient(int sock_fd);
+
+/* processWorkers.cpp */
+int startWorkers(int count, int max_queued);
+bool workersRunning(void);
+void queueRequest(int sock_fd, struct packet &req);
+void queueClose(int sock_fd, bool client_eof);
+int runRequest(int sock_fd, struct packet &req);
 
 #endif /* FUNC_LIB_H_ */
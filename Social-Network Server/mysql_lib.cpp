@@ -1,4 +1,6 @@
 #include "mysql_lib.h"
+#include "stats.h"
+#include "spans.h"
 
 string wall_entry_format(string timestamp, string poster, string postee,
 		string content) {
@@ -6,6 +8,392 @@ string wall_entry_format(string timestamp, string poster, string postee,
 	return poster + " to " + postee + "[" + timestamp + "]: " + content + "\n";
 }
 
+static std::string interaction_timestamp(void) {
+
+	//the format of NOW(6), in local time like the server on this host
+	auto now = std::chrono::system_clock::now();
+	time_t seconds = std::chrono::system_clock::to_time_t(now);
+	long us = std::chrono::duration_cast<std::chrono::microseconds>(
+			now.time_since_epoch()).count() % 1000000;
+	struct tm local;
+	char buf[32];
+
+	localtime_r(&seconds, &local);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+	snprintf(buf + 19, sizeof(buf) - 19, ".%06ld", us);
+	return buf;
+}
+
+static const char* const query_text[] = {
+	//QUERY_VALID_SESSION
+	"SELECT * FROM (SELECT * FROM SocialNetwork.InteractionLog WHERE "
+		"sessionID = ? ORDER BY TIMESTAMP DESC LIMIT 1) TEMP WHERE "
+		"ADDTIME(TIMESTAMP, CONCAT('00:', ? ,':00')) > NOW() AND logout <> 1",
+	//QUERY_LOGIN
+	"select * from Users where userName = ? and passwordHash = ?",
+	//QUERY_SESSION_EXISTS
+	"select * from InteractionLog where sessionID = ?",
+	//QUERY_LIST_USERS
+	"select userID, userName from Users order by userID",
+	//QUERY_WALL
+	"select Posts.postID, timestamp, content, userPostee.userName postee, userPoster.userName "
+		"poster from Posts join Users userPostee on userPostee.userID = Posts.posteeUserID "
+		"join Users userPoster on userPoster.userID = Posts.posterUserID "
+		"where userPostee.userName = ? and Posts.postID < ? order by Posts.postID desc limit ?",
+	//QUERY_INSERT_POST
+	"insert into Posts (posterUserID, posteeUserID, content) "
+		"select ?, postee.userID, ? from Users postee where postee.userName = ?",
+	//QUERY_LAST_INSERT_ID
+	"select last_insert_id() as post_id",
+	//QUERY_INIT_CURSOR
+	"insert ignore into NotificationCursors (userID, lastPostID) "
+		"select ?, coalesce(max(postID), 0) from Posts",
+	//QUERY_USER_NAME
+	"select userName from Users where userID = ?",
+	//QUERY_INSERT_INTERACTION
+	"insert into InteractionLog (userID, sessionID, logout, socketDescriptor, command, timestamp) "
+		"values (?, ?, ?, ?, ?, ?)",
+	//QUERY_USER_ID
+	"select * from Users where userName = ?",
+	//QUERY_ONLINE_USERS
+	"select IntLog2.userID, IntLog1.socketDescriptor from "
+		"(select userID, max(timestamp) maxTimestamp from InteractionLog group by userID) IntLog2 join "
+		"(select userID, timestamp, logout, socketDescriptor from InteractionLog) IntLog1 "
+		"on IntLog1.userID = IntLog2.userID "
+		"and IntLog1.timestamp = IntLog2.maxTimestamp "
+		"where logout <>1 "
+		"and ADDTIME(TIMESTAMP, CONCAT('00:', ? ,':00')) > NOW()",
+	//QUERY_GET_CURSOR
+	"select lastPostID from NotificationCursors where userID = ?",
+	//QUERY_NEW_POSTS
+	"select Posts.postID, Posts.content, Posts.timestamp, Poster.userName poster, Postee.userName postee "
+		"from Posts "
+		"join Users Poster on Poster.userID = Posts.posterUserID "
+		"join Users Postee on Postee.userID = Posts.posteeUserID "
+		"where Posts.postID > ? order by Posts.postID limit ?",
+	//QUERY_ADVANCE_CURSORS, one row per cursor of a batch (NOTIFICATION_READ_BATCH)
+	"insert into NotificationCursors (userID, lastPostID) values "
+		"(?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?), "
+		"(?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?), (?, ?) "
+		"on duplicate key update lastPostID = greatest(lastPostID, values(lastPostID))",
+	//QUERY_INSERT_INTERACTIONS, one row per interaction of a batch (INTERACTION_LOG_BATCH)
+	"insert into InteractionLog (userID, sessionID, logout, socketDescriptor, command, timestamp) values "
+		"(?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), "
+		"(?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), "
+		"(?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), "
+		"(?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?), (?, ?, ?, ?, ?, ?)",
+	//QUERY_INSERT_POST_BY_ID
+	"insert into Posts (posterUserID, posteeUserID, content) values (?, ?, ?)",
+};
+static_assert(sizeof(query_text) / sizeof(query_text[0]) == QUERY_COUNT,
+		"query_text must have an entry for each queryID");
+
+PreparedStatementCache::PreparedStatementCache() {
+
+	for (int i = 0; i < QUERY_COUNT; i++) {
+		statements[i] = NULL;
+	}
+}
+
+PreparedStatementCache::~PreparedStatementCache() {
+
+	clear();
+}
+
+sql::PreparedStatement* PreparedStatementCache::get(sql::Connection* con,
+		queryID id) {
+
+	if (statements[id] == NULL) {
+		statements[id] = con->prepareStatement(query_text[id]);
+	}
+	return statements[id];
+}
+
+void PreparedStatementCache::clear(void) {
+
+	for (int i = 0; i < QUERY_COUNT; i++) {
+		delete statements[i];
+		statements[i] = NULL;
+	}
+}
+
+SessionTable::SessionTable() {
+
+	for (int i = 0; i < SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].last_sweep = std::chrono::steady_clock::now();
+	}
+}
+
+SessionTable::~SessionTable() {
+
+	for (int i = 0; i < SHARDS; i++) {
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+}
+
+int SessionTable::lookup(unsigned int session_id, unsigned int* user_id,
+		unsigned int* socket_descriptor) {
+
+	shard& sh = shards[session_id % SHARDS];
+	auto now = std::chrono::steady_clock::now();
+
+	pthread_mutex_lock(&sh.lock);
+	auto it = sh.sessions.find(session_id);
+	if (it == sh.sessions.end()) {
+		pthread_mutex_unlock(&sh.lock);
+		return -1;
+	}
+	if (now - it->second.last_activity >= std::chrono::minutes(session_timeout)) {
+		sh.sessions.erase(it);
+		pthread_mutex_unlock(&sh.lock);
+		return -1;
+	}
+	if (it->second.logout) {
+		pthread_mutex_unlock(&sh.lock);
+		return -2;
+	}
+	if (user_id != NULL) {
+		*user_id = it->second.user_id;
+	}
+	if (socket_descriptor != NULL) {
+		*socket_descriptor = it->second.socket_descriptor;
+	}
+	pthread_mutex_unlock(&sh.lock);
+	return 0;
+}
+
+void SessionTable::update(unsigned int session_id, bool logout,
+		unsigned int user_id, unsigned int socket_descriptor) {
+
+	shard& sh = shards[session_id % SHARDS];
+	auto now = std::chrono::steady_clock::now();
+
+	pthread_mutex_lock(&sh.lock);
+	sh.sessions[session_id] = {user_id, socket_descriptor, now, logout};
+	if (now - sh.last_sweep >= std::chrono::minutes(session_timeout)) {
+		//drop the sessions nobody came back to, at most once per timeout
+		for (auto it = sh.sessions.begin(); it != sh.sessions.end();) {
+			if (now - it->second.last_activity >= std::chrono::minutes(session_timeout)) {
+				it = sh.sessions.erase(it);
+			} else {
+				it++;
+			}
+		}
+		sh.last_sweep = now;
+	}
+	pthread_mutex_unlock(&sh.lock);
+}
+
+void SessionTable::onlineUsers(
+		std::unordered_map<unsigned int, unsigned int>& sockets) {
+
+	std::unordered_map<unsigned int, std::chrono::steady_clock::time_point> latest;
+	auto now = std::chrono::steady_clock::now();
+
+	sockets.clear();
+	for (int i = 0; i < SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		for (auto& session : shards[i].sessions) {
+			const sessionEntry& entry = session.second;
+			if (entry.logout
+					|| now - entry.last_activity >= std::chrono::minutes(session_timeout)) {
+				continue;
+			}
+			auto it = latest.find(entry.user_id);
+			if (it == latest.end() || it->second < entry.last_activity) {
+				latest[entry.user_id] = entry.last_activity;
+				sockets[entry.user_id] = entry.socket_descriptor;
+			}
+		}
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
+
+std::string user_name_key(const std::string& user_name) {
+
+	//user names compare case insensitively and without trailing spaces, like the Users table does
+	std::string name = user_name;
+	name.erase(name.find_last_not_of(' ') + 1);
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	return name;
+}
+
+std::string list_version(const std::string& list) {
+
+	return std::to_string(std::hash<std::string>()(list));
+}
+
+WallCache::WallCache() {
+
+	pthread_mutex_init(&lock, NULL);
+	stat_reported = std::chrono::steady_clock::now();
+}
+
+WallCache::~WallCache() {
+
+	pthread_mutex_destroy(&lock);
+}
+
+int WallCache::lookup(const std::string& wall_owner, unsigned int before,
+		unsigned int limit, std::string* page, unsigned int* next,
+		unsigned int* latest, unsigned long* generation) {
+
+	std::string owner = user_name_key(wall_owner);
+	std::string key = owner + '\0' + std::to_string(before) + ' '
+			+ std::to_string(limit);
+	auto now = std::chrono::steady_clock::now();
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	auto found = index.find(key);
+	if (found != index.end() && found->second->newest
+			&& found->second->generation != generation_of(owner)) {
+		//posted on since it was read
+		remove(found->second);
+		found = index.end();
+	}
+	if (found != index.end()) {
+		pages.splice(pages.begin(), pages, found->second);
+		*page = found->second->page;
+		*next = found->second->next;
+		*latest = found->second->latest;
+		stat_hits++;
+		ret = 0;
+	} else {
+		*generation = generation_of(owner);
+		stat_misses++;
+	}
+	if (now - stat_reported >= std::chrono::seconds(stats_interval)) {
+		std::cout << "Wall cache: " << stat_hits << " hits, " << stat_misses
+				<< " misses, " << stat_evictions << " evictions, "
+				<< pages.size() << " pages, " << bytes << " bytes" << std::endl;
+		stat_reported = now;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void WallCache::insert(const std::string& wall_owner, unsigned int before,
+		unsigned int limit, unsigned long generation, const std::string& page,
+		unsigned int next, unsigned int latest) {
+
+	std::string owner = user_name_key(wall_owner);
+	std::string key = owner + '\0' + std::to_string(before) + ' '
+			+ std::to_string(limit);
+	size_t size = sizeof(wallPage) + 2 * key.length() + owner.length()
+			+ page.length();
+
+	if (size > max_bytes) {
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	if (generation_of(owner) != generation) {
+		//posted on while it was read, it may be missing the post
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	auto found = index.find(key);
+	if (found != index.end()) {
+		remove(found->second);
+	}
+	pages.push_front({key, owner, before == 0, generation, page, next, latest});
+	index[key] = pages.begin();
+	bytes += size;
+	while (bytes > max_bytes && !pages.empty()) {
+		remove(std::prev(pages.end()));
+		stat_evictions++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void WallCache::invalidate(const std::string& wall_owner) {
+
+	std::string owner = user_name_key(wall_owner);
+
+	//the newest pages of the wall are dropped when looked up next
+	pthread_mutex_lock(&lock);
+	auto found = generations.find(owner);
+	if (found == generations.end()) {
+		//one entry per wall posted on, at most one per user
+		found = generations.emplace(owner, 0).first;
+		bytes += sizeof(std::pair<std::string, unsigned long>) + owner.length();
+	}
+	found->second++;
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned long WallCache::generation_of(const std::string& owner) {
+
+	auto found = generations.find(owner);
+	return found == generations.end() ? 0 : found->second;
+}
+
+void WallCache::remove(std::list<wallPage>::iterator it) {
+
+	bytes -= sizeof(wallPage) + 2 * it->key.length() + it->owner.length()
+			+ it->page.length();
+	index.erase(it->key);
+	pages.erase(it);
+}
+
+UserDirectory::UserDirectory() : refreshing(false) {
+}
+
+std::shared_ptr<const UserDirectory::snapshot> UserDirectory::current(void) {
+
+	return std::atomic_load(&users);
+}
+
+bool UserDirectory::claimRefresh(const std::shared_ptr<const snapshot>& seen,
+		bool missed) {
+
+	auto now = std::chrono::steady_clock::now();
+	bool expected = false;
+
+	if (seen != NULL && !missed
+			&& now - seen->loaded < std::chrono::seconds(refresh_interval)) {
+		return false;
+	}
+	if (!refreshing.compare_exchange_strong(expected, true)) {
+		//another thread is reading the table
+		return false;
+	}
+	if (seen != NULL
+			&& now - seen->loaded < std::chrono::seconds(refresh_interval)
+			&& now - tried < std::chrono::seconds(miss_interval)) {
+		//read for a missing name a moment ago
+		refreshing.store(false);
+		return false;
+	}
+	tried = now;
+	return true;
+}
+
+void UserDirectory::publish(
+		const std::vector<std::pair<unsigned int, std::string> >& users) {
+
+	std::shared_ptr<snapshot> next = std::make_shared<snapshot>();
+
+	for (size_t i = 0; i < users.size(); i++) {
+		next->ids[user_name_key(users[i].second)] = users[i].first;
+		next->names[users[i].first] = users[i].second;
+		if (i > 0) {
+			next->list += "\n";
+		}
+		next->list += std::to_string(i + 1) + " - " + users[i].second;
+	}
+	next->loaded = std::chrono::steady_clock::now();
+	next->version = list_version(next->list);
+	std::atomic_store(&this->users, std::shared_ptr<const snapshot>(next));
+	refreshing.store(false);
+}
+
+void UserDirectory::abandon(void) {
+
+	refreshing.store(false);
+}
+
 MySQLDatabaseDriver::MySQLDatabaseDriver() {
 
 	try {
@@ -23,12 +411,240 @@ MySQLDatabaseDriver::MySQLDatabaseDriver() {
 MySQLDatabaseDriver::~MySQLDatabaseDriver() {
 }
 
+InteractionLogWriter::InteractionLogWriter() {
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&queued_cond, NULL);
+	pthread_cond_init(&room_cond, NULL);
+	stat_reported = std::chrono::steady_clock::now();
+}
+
+InteractionLogWriter::~InteractionLogWriter() {
+
+	stop();
+	statements.clear();
+	delete con;
+	pthread_cond_destroy(&room_cond);
+	pthread_cond_destroy(&queued_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int InteractionLogWriter::start(MySQLDatabaseDriver databaseDriver,
+		std::string server_url, std::string server_username,
+		std::string server_password, std::string server_database) {
+
+	driver = databaseDriver.driver;
+	this->server_url = server_url;
+	this->server_username = server_username;
+	this->server_password = server_password;
+	this->server_database = server_database;
+	try {
+		con = driver->connect(server_url, server_username, server_password);
+		con->setSchema(server_database);
+		//a flush commits once for all its rows
+		con->setAutoCommit(false);
+	} catch (sql::SQLException &e) {
+		std::cout << "# ERR: SQLException in " << __FILE__;
+		std::cout << "(" << __FUNCTION__ << ") on line " << __LINE__
+				<< std::endl;
+		std::cout << "# ERR: " << e.what();
+		std::cout << " (MySQL error code: " << e.getErrorCode();
+		std::cout << ", SQLState: " << e.getSQLState() << " )" << std::endl;
+
+		delete con;
+		con = NULL;
+		return -2;
+	}
+	running = true;
+	if (pthread_create(&thread, NULL, run, this) != 0) {
+		running = false;
+		return -2;
+	}
+	return 0;
+}
+
+int InteractionLogWriter::add(unsigned int user_id, unsigned int session_id,
+		bool logout, unsigned int socket_descriptor, std::string command) {
+
+	pthread_mutex_lock(&lock);
+	if (queue.size() >= max_queued && running && !stopping) {
+		stat_full_waits++;
+		while (queue.size() >= max_queued && running && !stopping) {
+			pthread_cond_wait(&room_cond, &lock);
+		}
+	}
+	if (!running || stopping) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	queue.push_back({user_id, session_id, logout, socket_descriptor, command,
+			interaction_timestamp(), std::chrono::steady_clock::now()});
+	if (queue.size() == INTERACTION_LOG_BATCH || queue.size() == 1) {
+		//a full batch to write, or a deadline to start waiting for
+		pthread_cond_signal(&queued_cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+void InteractionLogWriter::stop(void) {
+
+	pthread_mutex_lock(&lock);
+	if (!running || stopping) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_signal(&queued_cond);
+	pthread_cond_broadcast(&room_cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	pthread_mutex_lock(&lock);
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+void* InteractionLogWriter::run(void* writer) {
+
+	InteractionLogWriter* self = (InteractionLogWriter*) writer;
+	std::vector<interaction> rows;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&self->lock);
+	while (true) {
+		while (!self->stopping && self->queue.size() < INTERACTION_LOG_BATCH) {
+			if (self->queue.empty()) {
+				pthread_cond_wait(&self->queued_cond, &self->lock);
+				continue;
+			}
+			auto waited = std::chrono::steady_clock::now() - self->queue.front().queued;
+			if (waited >= std::chrono::milliseconds(self->flush_interval)) {
+				break;
+			}
+			//sleep until the oldest row has waited flush_interval
+			long wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::milliseconds(self->flush_interval) - waited).count();
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += (deadline.tv_nsec + wait_ns) / 1000000000;
+			deadline.tv_nsec = (deadline.tv_nsec + wait_ns) % 1000000000;
+			pthread_cond_timedwait(&self->queued_cond, &self->lock, &deadline);
+		}
+		if (self->queue.empty()) {
+			//stopping with nothing left to write
+			break;
+		}
+		rows.assign(self->queue.begin(), self->queue.end());
+		self->queue.clear();
+		pthread_cond_broadcast(&self->room_cond);
+		pthread_mutex_unlock(&self->lock);
+
+		int ret = self->write(rows);
+		auto now = std::chrono::steady_clock::now();
+
+		pthread_mutex_lock(&self->lock);
+		if (ret != 0) {
+			if (self->stopping) {
+				std::cout << "Interaction log: " << rows.size()
+						<< " rows not written at shutdown" << std::endl;
+				break;
+			}
+			//keep the rows in order ahead of the ones added meanwhile, retry in a second
+			self->queue.insert(self->queue.begin(), rows.begin(), rows.end());
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += 1;
+			pthread_cond_timedwait(&self->queued_cond, &self->lock, &deadline);
+			continue;
+		}
+		self->stat_commits++;
+		for (interaction& row : rows) {
+			unsigned long lag_ms = std::chrono::duration_cast<
+					std::chrono::milliseconds>(now - row.queued).count();
+			self->stat_rows++;
+			self->stat_lag_total_ms += lag_ms;
+			if (lag_ms > self->stat_lag_max_ms) {
+				self->stat_lag_max_ms = lag_ms;
+			}
+		}
+		if (now - self->stat_reported >= std::chrono::seconds(self->stats_interval)) {
+			std::cout << "Interaction log: " << self->stat_rows << " rows, "
+					<< self->stat_commits << " commits, queue lag avg "
+					<< self->stat_lag_total_ms / self->stat_rows << " ms max "
+					<< self->stat_lag_max_ms << " ms, " << self->queue.size()
+					<< " queued, " << self->stat_full_waits << " waited for room"
+					<< std::endl;
+			self->stat_reported = now;
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+	return NULL;
+}
+
+int InteractionLogWriter::write(std::vector<interaction>& rows) {
+
+	size_t i = 0;
+
+	try {
+		if (con == NULL) {
+			con = driver->connect(server_url, server_username, server_password);
+			con->setSchema(server_database);
+			con->setAutoCommit(false);
+		}
+		pstmt = statements.get(con, QUERY_INSERT_INTERACTIONS);
+		for (; i + INTERACTION_LOG_BATCH <= rows.size(); i += INTERACTION_LOG_BATCH) {
+			for (int j = 0; j < INTERACTION_LOG_BATCH; j++) {
+				interaction& row = rows[i + j];
+				pstmt->setUInt(6 * j + 1, row.user_id);
+				pstmt->setUInt(6 * j + 2, row.session_id);
+				pstmt->setBoolean(6 * j + 3, row.logout);
+				pstmt->setUInt(6 * j + 4, row.socket_descriptor);
+				pstmt->setString(6 * j + 5, row.command);
+				pstmt->setString(6 * j + 6, row.timestamp);
+			}
+			pstmt->executeUpdate();
+		}
+		//the rest of a batch one at a time, still in the same transaction
+		pstmt = statements.get(con, QUERY_INSERT_INTERACTION);
+		for (; i < rows.size(); i++) {
+			pstmt->setUInt(1, rows[i].user_id);
+			pstmt->setUInt(2, rows[i].session_id);
+			pstmt->setBoolean(3, rows[i].logout);
+			pstmt->setUInt(4, rows[i].socket_descriptor);
+			pstmt->setString(5, rows[i].command);
+			pstmt->setString(6, rows[i].timestamp);
+			pstmt->executeUpdate();
+		}
+		con->commit();
+		return 0;
+
+	} catch (sql::SQLException &e) {
+		std::cout << "# ERR: SQLException in " << __FILE__;
+		std::cout << "(" << __FUNCTION__ << ") on line " << __LINE__
+				<< std::endl;
+		std::cout << "# ERR: " << e.what();
+		std::cout << " (MySQL error code: " << e.getErrorCode();
+		std::cout << ", SQLState: " << e.getSQLState() << " )" << std::endl;
+
+		//the connection may be gone, open a new one for the retry
+		statements.clear();
+		delete con;
+		con = NULL;
+		return -2;
+	}
+
+	return -2;
+}
+
 DatabaseCommandInterface::DatabaseCommandInterface(
 		MySQLDatabaseDriver databaseDriver, std::string server_url,
 		std::string server_username, std::string server_password,
 		std::string server_database) {
 
 	driver = databaseDriver.driver;
+	this->server_url = server_url;
+	this->server_username = server_username;
+	this->server_password = server_password;
+	this->server_database = server_database;
 	try {
 		con = driver->connect(server_url, server_username, server_password);
 		con->setSchema(server_database);
@@ -44,7 +660,95 @@ DatabaseCommandInterface::DatabaseCommandInterface(
 
 DatabaseCommandInterface::~DatabaseCommandInterface() {
 
+	statements.clear();
+	delete con;
+}
+
+bool DatabaseCommandInterface::isConnected(void) {
+
+	if (con == NULL) {
+		return false;
+	}
+	try {
+		return !con->isClosed() && con->isValid();
+	} catch (sql::SQLException &e) {
+		return false;
+	}
+}
+
+int DatabaseCommandInterface::reconnect(void) {
+
+	sql::Connection* new_con = NULL;
+
+	try {
+		new_con = driver->connect(server_url, server_username, server_password);
+		new_con->setSchema(server_database);
+	} catch (sql::SQLException &e) {
+		std::cout << "# ERR: SQLException in " << __FILE__;
+		std::cout << "(" << __FUNCTION__ << ") on line " << __LINE__
+				<< std::endl;
+		std::cout << "# ERR: " << e.what();
+		std::cout << " (MySQL error code: " << e.getErrorCode();
+		std::cout << ", SQLState: " << e.getSQLState() << " )" << std::endl;
+
+		delete new_con;
+		return -2;
+	}
+
+	//the cached statements belong to the old connection
+	statements.clear();
 	delete con;
+	con = new_con;
+	return 0;
+}
+
+void DatabaseCommandInterface::useSessionTable(SessionTable* sessions) {
+
+	this->sessions = sessions;
+}
+
+void DatabaseCommandInterface::useWallCache(WallCache* walls) {
+
+	this->walls = walls;
+}
+
+void DatabaseCommandInterface::useUserDirectory(UserDirectory* directory) {
+
+	this->directory = directory;
+}
+
+int DatabaseCommandInterface::refreshUsers(void) {
+
+	statsTimer timer(DB_REFRESH_USERS);
+	std::vector<std::pair<unsigned int, std::string> > users;
+
+	try {
+		pstmt = statements.get(con, QUERY_LIST_USERS);
+		res = pstmt->executeQuery();
+		while (res->next()) {
+			users.push_back(std::make_pair(res->getUInt("userID"),
+					res->getString("userName")));
+		}
+		delete res;
+
+	} catch (sql::SQLException &e) {
+		std::cout << "# ERR: SQLException in " << __FILE__;
+		std::cout << "(" << __FUNCTION__ << ") on line " << __LINE__
+				<< std::endl;
+		std::cout << "# ERR: " << e.what();
+		std::cout << " (MySQL error code: " << e.getErrorCode();
+		std::cout << ", SQLState: " << e.getSQLState() << " )" << std::endl;
+
+		return -2;
+	}
+
+	directory->publish(users);
+	return 0;
+}
+
+void DatabaseCommandInterface::useInteractionLog(InteractionLogWriter* writer) {
+
+	this->interactions = writer;
 }
 
 void DatabaseCommandInterface::getResults(std::string query) {
@@ -70,6 +774,8 @@ void DatabaseCommandInterface::getResults(std::string query) {
 int DatabaseCommandInterface::hasValidSession(struct packet& pkt,
 		unsigned int* user_id, unsigned int* socket_descriptor) {
 
+	statsTimer timer(DB_HAS_VALID_SESSION);
+
 	/*
 	 * query the database for a matching session from the most recent row
 	 * that is sooner than the timeout and isn't logout
@@ -78,13 +784,22 @@ int DatabaseCommandInterface::hasValidSession(struct packet& pkt,
 	 * is just an "invalid session" error message
 	 */
 
+	unsigned int temp_user_id, temp_socket_descriptor;
+
+	if (sessions != NULL) {
+		switch (sessions->lookup(pkt.sessionId, user_id, socket_descriptor)) {
+		case 0:
+			return 0;
+		case -2:
+			//logged out, the database may not have the logout row yet
+			pkt.contents.rcvd_cnts = "Invalid Session";
+			return -1;
+		}
+	}
+
 	try {
 		//This query only looks at sessions. This allows a single user to be logged into multiple sessions.
-		pstmt =
-				con->prepareStatement(
-						"SELECT * FROM (SELECT * FROM SocialNetwork.InteractionLog WHERE "
-								"sessionID = ? ORDER BY TIMESTAMP DESC LIMIT 1) TEMP WHERE "
-								"ADDTIME(TIMESTAMP, CONCAT('00:', ? ,':00')) > NOW() AND logout <> 1");
+		pstmt = statements.get(con, QUERY_VALID_SESSION);
 		pstmt->setUInt(1, pkt.sessionId);
 		pstmt->setUInt(2, session_timeout);
 		res = pstmt->executeQuery();
@@ -92,28 +807,31 @@ int DatabaseCommandInterface::hasValidSession(struct packet& pkt,
 		switch (res->rowsCount()) {
 		case 1:
 			//valid session
+			res->first();
+			temp_user_id = res->getUInt("userID");
+			temp_socket_descriptor = res->getUInt("socketDescriptor");
 			if (user_id != NULL) {
-				res->first();
-				*user_id = res->getUInt("userID");
+				*user_id = temp_user_id;
 			}
 			if (socket_descriptor != NULL) {
-				res->first();
-				*socket_descriptor = res->getUInt("socketDescriptor");
+				*socket_descriptor = temp_socket_descriptor;
+			}
+			if (sessions != NULL) {
+				//not in the table (e.g. opened before a restart), keep it there from now on
+				sessions->update(pkt.sessionId, false, temp_user_id,
+						temp_socket_descriptor);
 			}
 
-			delete pstmt;
 			delete res;
 			return 0;
 			break;
 		case 0:
 			//invalid session
-			delete pstmt;
 			delete res;
 			pkt.contents.rcvd_cnts = "Invalid Session";
 			return -1;
 			break;
 		default:
-			delete pstmt;
 			delete res;
 			pkt.contents.rcvd_cnts = "Server Error";
 			return -2;
@@ -138,14 +856,14 @@ int DatabaseCommandInterface::hasValidSession(struct packet& pkt,
 int DatabaseCommandInterface::login(struct packet &pkt,
 		unsigned int socket_descriptor) {
 
+	statsTimer timer(DB_LOGIN);
 	bool valid_session_id = false;
 	unsigned int temp_session_id, temp_user_id;
 	srand(time(NULL));
 
 	try {
 		//check for valid username and password
-		pstmt = con->prepareStatement(
-				"select * from Users where userName = ? and passwordHash = ?");
+		pstmt = statements.get(con, QUERY_LOGIN);
 		pstmt->setString(1, pkt.contents.username);
 		pstmt->setString(2, pkt.contents.password);
 		res = pstmt->executeQuery();
@@ -154,19 +872,21 @@ int DatabaseCommandInterface::login(struct packet &pkt,
 			//username and password does not exist or is incorrect
 			pkt.contents.rcvd_cnts =
 					"Username and/or password incorrect or does not exist";
-			delete pstmt;
 			delete res;
 			return -1;
 		}
 		//username and password exists and is correct
 		res->first();
 		temp_user_id = res->getUInt("userID");
-		delete pstmt;
 		delete res;
 
+		//users without a notification cursor start at the latest post
+		pstmt = statements.get(con, QUERY_INIT_CURSOR);
+		pstmt->setUInt(1, temp_user_id);
+		pstmt->executeUpdate();
+
 		//generate and check for valid session_id
-		pstmt = con->prepareStatement(
-				"select * from InteractionLog where sessionID = ?");
+		pstmt = statements.get(con, QUERY_SESSION_EXISTS);
 		while (!valid_session_id) {
 
 			temp_session_id = (unsigned int) round(
@@ -175,13 +895,13 @@ int DatabaseCommandInterface::login(struct packet &pkt,
 			pstmt->setUInt(1, temp_session_id);
 			res = pstmt->executeQuery();
 
-			if (res->rowsCount() == 0) {
-				//session_id doesn't already exist in table, use this session id
+			if (res->rowsCount() == 0 && (sessions == NULL
+					|| sessions->lookup(temp_session_id) == -1)) {
+				//session_id doesn't already exist in table (or in rows still queued), use this session id
 				valid_session_id = true;
 			}
 			delete res;
 		}
-		delete pstmt;
 
 		//insert row in interaction log
 		if (insertInteractionLog(temp_session_id, false,
@@ -212,32 +932,42 @@ int DatabaseCommandInterface::login(struct packet &pkt,
 	return -2;
 }
 
-int DatabaseCommandInterface::listUsers(struct packet &pkt) {
+int DatabaseCommandInterface::listUsers(struct packet &pkt,
+		std::string* version) {
 
+	statsTimer timer(DB_LIST_USERS);
 	std::string temp;
+	std::shared_ptr<const UserDirectory::snapshot> users;
 	try {
-		stmt = con->createStatement();
-		res = stmt->executeQuery("select userName from Users");
+		if (directory != NULL) {
+			users = getUsers();
+		}
+		if (users != NULL) {
+			//rendered when the directory was read
+			temp = users->list;
+		} else {
+			pstmt = statements.get(con, QUERY_LIST_USERS);
+			res = pstmt->executeQuery();
 
-		if (res->rowsCount() < 1) {
-			//SQL not returning users
-			delete stmt;
+			//format results
+			while (res->next()) {
+				temp += std::to_string(res->getRow()) + " - "
+						+ res->getString("userName");
+				if (!res->isLast()) {
+					temp += "\n";
+				}
+			}
 			delete res;
+		}
 
+		if (temp.empty()) {
+			//SQL not returning users
 			pkt.contents.rcvd_cnts = "Server Error";
 			return -2;
 		}
-
-		//format results
-		while (res->next()) {
-			temp += std::to_string(res->getRow()) + " - "
-					+ res->getString("userName");
-			if (!res->isLast()) {
-				temp += "\n";
-			}
+		if (version != NULL) {
+			*version = users != NULL ? users->version : list_version(temp);
 		}
-		delete stmt;
-		delete res;
 
 		if (insertInteractionLog(pkt.sessionId, false, "LIST") != 0) {
 			pkt.contents.rcvd_cnts = "Server Error";
@@ -264,53 +994,82 @@ int DatabaseCommandInterface::listUsers(struct packet &pkt) {
 	return -2;
 }
 
-int DatabaseCommandInterface::showWall(struct packet &pkt) {
+int DatabaseCommandInterface::showWall(struct packet &pkt, unsigned int before,
+		unsigned int limit, unsigned int* next, unsigned int* latest,
+		bool log) {
 
-	std::string temp;
-	try {
-		switch (getUserID(pkt.contents.wallOwner)) {
-		case 0:
-			//user exists
-			break;
-		case -1:
-			pkt.contents.rcvd_cnts = "User doesn't exist";
-			return -1;
-			break;
-		case -2:
-			pkt.contents.rcvd_cnts = "Server Error";
-			return -2;
-			break;
-		}
+	statsTimer timer(DB_SHOW_WALL);
+	std::string temp, entry;
+	unsigned int rows = 0, last_post_id = 0;
+	unsigned long generation = 0;
 
-		//get requested user's wall
-		pstmt =
-				con->prepareStatement(
-						"select timestamp, content, userPostee.userName postee, userPoster.userName "
-								"poster from Posts join Users userPostee on userPostee.userID = Posts.posteeUserID "
-								"join Users userPoster on userPoster.userID = Posts.posterUserID "
-								"where userPostee.userName = ? order by timestamp asc");
-		pstmt->setString(1, pkt.contents.wallOwner);
-		res = pstmt->executeQuery();
+	*next = 0;
+	*latest = 0;
+	if (limit == 0 || limit > WALL_PAGE_POSTS) {
+		limit = WALL_PAGE_POSTS;
+	}
+	try {
+		if (walls == NULL || walls->lookup(pkt.contents.wallOwner, before,
+				limit, &temp, next, latest, &generation) != 0) {
+			switch (getUserID(pkt.contents.wallOwner)) {
+			case 0:
+				//user exists
+				break;
+			case -1:
+				pkt.contents.rcvd_cnts = "User doesn't exist";
+				return -1;
+				break;
+			case -2:
+				pkt.contents.rcvd_cnts = "Server Error";
+				return -2;
+				break;
+			}
 
+			//get one page of requested user's wall, one post more tells if another page follows
+			pstmt = statements.get(con, QUERY_WALL);
+			pstmt->setString(1, pkt.contents.wallOwner);
+			pstmt->setUInt(2, before == 0 ? UINT_MAX : before);
+			pstmt->setUInt(3, limit + 1);
+			res = pstmt->executeQuery();
 
-		if (res->rowsCount() == 0) {
-			//no wall contents for user
-			temp = "No wall contents";
-		} else {
 			//generate wall contents
 			while (res->next()) {
-				temp += wall_entry_format(res->getString("timestamp"),
+				entry = wall_entry_format(res->getString("timestamp"),
 						res->getString("poster"), res->getString("postee"),
 						res->getString("content"));
-				if (!res->isLast()) {
+				if (rows == limit || (rows > 0
+						&& temp.length() + 2 + entry.length() > WALL_PAGE_BYTES)) {
+					//the page is full, the rest comes with the next one
+					*next = last_post_id;
+					break;
+				}
+				if (entry.length() > WALL_PAGE_BYTES) {
+					//a post too long for a frame of its own is cut
+					entry.resize(WALL_PAGE_BYTES);
+				}
+				if (rows > 0) {
 					temp += "\n\n";
 				}
+				temp += entry;
+				last_post_id = res->getUInt("postID");
+				if (rows == 0) {
+					*latest = last_post_id;
+				}
+				rows++;
+			}
+			delete res;
+
+			if (rows == 0) {
+				//no wall contents for user
+				temp = before == 0 ? "No wall contents" : "No older posts";
+			}
+			if (walls != NULL) {
+				walls->insert(pkt.contents.wallOwner, before, limit, generation,
+						temp, *next, *latest);
 			}
 		}
-		delete pstmt;
-		delete res;
 
-		if (insertInteractionLog(pkt.sessionId, false,
+		if (log && insertInteractionLog(pkt.sessionId, false,
 				"SHOW " + pkt.contents.wallOwner) != 0) {
 			pkt.contents.rcvd_cnts = "Server Error";
 			return -2;
@@ -338,7 +1097,9 @@ int DatabaseCommandInterface::showWall(struct packet &pkt) {
 
 int DatabaseCommandInterface::postOnWall(struct packet &pkt) {
 
-	unsigned int poster_id, post_id;
+	statsTimer timer(DB_POST_ON_WALL);
+	unsigned int poster_id, postee_id, post_id;
+	std::chrono::steady_clock::time_point span;
 	try {
 		/*
 		 * determine poster_id and attempt inserting post.
@@ -350,31 +1111,49 @@ int DatabaseCommandInterface::postOnWall(struct packet &pkt) {
 			return -2;
 		}
 
-		pstmt =
-				con->prepareStatement(
-						"insert into Posts (posterUserID, posteeUserID, content) "
-								"select ?, postee.userID, ? from Users postee where postee.userName = ?");
-		pstmt->setUInt(1, poster_id);
-		pstmt->setString(2, pkt.contents.post);
-		pstmt->setString(3, pkt.contents.postee);
+		if (directory != NULL) {
+			//the postee comes from the directory, the insert needs no lookup
+			switch (getUserID(pkt.contents.postee, &postee_id)) {
+			case -1:
+				pkt.contents.rcvd_cnts = "User doesn't exist";
+				return -1;
+			case -2:
+				pkt.contents.rcvd_cnts = "Server Error";
+				return -2;
+			}
+			pstmt = statements.get(con, QUERY_INSERT_POST_BY_ID);
+			pstmt->setUInt(1, poster_id);
+			pstmt->setUInt(2, postee_id);
+			pstmt->setString(3, pkt.contents.post);
+		} else {
+			pstmt = statements.get(con, QUERY_INSERT_POST);
+			pstmt->setUInt(1, poster_id);
+			pstmt->setString(2, pkt.contents.post);
+			pstmt->setString(3, pkt.contents.postee);
+		}
 
+		span = spanStart();
 		if (pstmt->executeUpdate() != 1) {
 			//postee user doesn't exist
-			delete pstmt;
+			spanEnd("db.insertPost", span);
 			pkt.contents.rcvd_cnts = "User doesn't exist";
 			return -1;
 		}
+		spanEnd("db.insertPost", span);
+		if (walls != NULL) {
+			walls->invalidate(pkt.contents.postee);
+		}
 
-		delete pstmt;
-		//post made successfully
+		//post made successfully, the notification thread delivers it to
+		//each online user whose cursor is behind it
 
-		//insert post and users into notifications table
-		//get newly created post_id
-		stmt = con->createStatement();
-		res = stmt->executeQuery("select last_insert_id() as post_id");
+		//get newly created post_id for the interaction log
+		span = spanStart();
+		pstmt = statements.get(con, QUERY_LAST_INSERT_ID);
+		res = pstmt->executeQuery();
+		spanEnd("db.lastInsertId", span);
 
 		if (res->rowsCount() != 1) {
-			delete stmt;
 			delete res;
 
 			pkt.contents.rcvd_cnts = "Server Error";
@@ -384,21 +1163,8 @@ int DatabaseCommandInterface::postOnWall(struct packet &pkt) {
 		res->first();
 		post_id = res->getUInt("post_id");
 
-		delete stmt;
 		delete res;
 
-		pstmt =
-				con->prepareStatement(
-						"insert into Notifications (postID, userID) select ?, userID from Users");
-		pstmt->setUInt(1, post_id);
-
-		if (pstmt->executeUpdate() < 1) {
-			pkt.contents.rcvd_cnts = "Server Error";
-			return -2;
-		}
-
-		delete pstmt;
-
 		insertInteractionLog(pkt.sessionId, false,
 				"POST " + pkt.contents.postee + " " + std::to_string(post_id));
 
@@ -422,6 +1188,7 @@ int DatabaseCommandInterface::postOnWall(struct packet &pkt) {
 
 int DatabaseCommandInterface::logout(struct packet& pkt) {
 
+	statsTimer timer(DB_LOGOUT);
 	unsigned int user_id;
 	std::string user_name;
 	try {
@@ -431,25 +1198,12 @@ int DatabaseCommandInterface::logout(struct packet& pkt) {
 			return -2;
 		}
 
-		pstmt = con->prepareStatement(
-				"select userName from Users where userID = ?");
-		pstmt->setUInt(1, user_id);
-		res = pstmt->executeQuery();
-
-		if (res->rowsCount() != 1) {
-			delete pstmt;
-			delete res;
+		if (getUserName(user_id, &user_name) != 0) {
 
 			pkt.contents.rcvd_cnts = "Server Error";
 			return -2;
 		}
 
-		res->first();
-		user_name = res->getString("userName");
-
-		delete pstmt;
-		delete res;
-
 		insertInteractionLog(pkt.sessionId, true, "LOGOUT " + user_name);
 
 		return 0;
@@ -494,6 +1248,7 @@ int DatabaseCommandInterface::insertInteractionLog(unsigned int session_id,
 		bool logout, std::string command, unsigned int user_id,
 		unsigned int socket_descriptor) {
 
+	spanScope span("db.insertInteractionLog");
 	try {
 		if (user_id == 0 || socket_descriptor == 0) {
 			//need to query for these if they aren't passed in
@@ -518,23 +1273,100 @@ int DatabaseCommandInterface::insertInteractionLog(unsigned int session_id,
 			}
 		}
 
-		pstmt =
-				con->prepareStatement(
-						"insert into InteractionLog (userID, sessionID, logout, socketDescriptor, command) "
-								"values (?, ?, ?, ?, ?)");
+		if (interactions != NULL && sessions != NULL) {
+			//the session table answers for the session until the row is written
+			sessions->update(session_id, logout, user_id, socket_descriptor);
+			if (interactions->add(user_id, session_id, logout,
+					socket_descriptor, command) == 0) {
+				return 0;
+			}
+		}
+
+		pstmt = statements.get(con, QUERY_INSERT_INTERACTION);
 		pstmt->setUInt(1, user_id);
 		pstmt->setUInt(2, session_id);
 		pstmt->setBoolean(3, logout);
 		pstmt->setUInt(4, socket_descriptor);
 		pstmt->setString(5, command);
+		pstmt->setString(6, interaction_timestamp());
 
 		if (pstmt->executeUpdate() != 1) {
 			//more or less than 1 row was affected - error condition
-			delete pstmt;
 			return -2;
 		}
 
-		delete pstmt;
+		if (sessions != NULL) {
+			sessions->update(session_id, logout, user_id, socket_descriptor);
+		}
+		return 0;
+
+	} catch (sql::SQLException &e) {
+		std::cout << "# ERR: SQLException in " << __FILE__;
+		std::cout << "(" << __FUNCTION__ << ") on line " << __LINE__
+				<< std::endl;
+		std::cout << "# ERR: " << e.what();
+		std::cout << " (MySQL error code: " << e.getErrorCode();
+		std::cout << ", SQLState: " << e.getSQLState() << " )" << std::endl;
+
+		return -2;
+	}
+
+	return -2;
+}
+
+std::shared_ptr<const UserDirectory::snapshot> DatabaseCommandInterface::getUsers(
+		bool missed) {
+
+	std::shared_ptr<const UserDirectory::snapshot> users = directory->current();
+
+	if (directory->claimRefresh(users, missed)) {
+		if (refreshUsers() != 0) {
+			//keep using the snapshot there is
+			directory->abandon();
+		}
+		users = directory->current();
+	}
+	return users;
+}
+
+int DatabaseCommandInterface::getUserName(unsigned int user_id,
+		std::string* user_name) {
+
+	std::shared_ptr<const UserDirectory::snapshot> users;
+
+	if (directory != NULL) {
+		users = getUsers();
+	}
+	if (users != NULL) {
+		auto found = users->names.find(user_id);
+		if (found == users->names.end()) {
+			//added since the directory was read
+			users = getUsers(true);
+			found = users->names.find(user_id);
+			if (found == users->names.end()) {
+				return -1;
+			}
+		}
+		*user_name = found->second;
+		return 0;
+	}
+
+	try {
+		pstmt = statements.get(con, QUERY_USER_NAME);
+		pstmt->setUInt(1, user_id);
+		res = pstmt->executeQuery();
+
+		if (res->rowsCount() != 1) {
+			delete res;
+
+			return -1;
+		}
+
+		res->first();
+		*user_name = res->getString("userName");
+
+		delete res;
+
 		return 0;
 
 	} catch (sql::SQLException &e) {
@@ -554,15 +1386,36 @@ int DatabaseCommandInterface::insertInteractionLog(unsigned int session_id,
 int DatabaseCommandInterface::getUserID(std::string user_name,
 		unsigned int* user_id) {
 
+	spanScope span("db.getUserID");
+	std::shared_ptr<const UserDirectory::snapshot> users;
+
+	if (directory != NULL) {
+		users = getUsers();
+	}
+	if (users != NULL) {
+		auto found = users->ids.find(user_name_key(user_name));
+		if (found == users->ids.end()) {
+			//added since the directory was read
+			users = getUsers(true);
+			found = users->ids.find(user_name_key(user_name));
+			if (found == users->ids.end()) {
+				return -1;
+			}
+		}
+		if (user_id != NULL) {
+			*user_id = found->second;
+		}
+		return 0;
+	}
+
 	try {
 		//see if requested user exists
-		pstmt = con->prepareStatement("select * from Users where userName = ?");
+		pstmt = statements.get(con, QUERY_USER_ID);
 		pstmt->setString(1, user_name);
 		res = pstmt->executeQuery();
 
 		if (res->rowsCount() == 0) {
 			//user doesn't exist
-			delete pstmt;
 			delete res;
 
 			return -1;
@@ -573,7 +1426,6 @@ int DatabaseCommandInterface::getUserID(std::string user_name,
 			*user_id = res->getUInt("userID");
 		}
 
-		delete pstmt;
 		delete res;
 
 		return 0;
@@ -592,6 +1444,132 @@ int DatabaseCommandInterface::getUserID(std::string user_name,
 	return -2;
 }
 
+DatabaseConnectionPool::DatabaseConnectionPool() {
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&idle_cond, NULL);
+	stat_reported = std::chrono::steady_clock::now();
+}
+
+DatabaseConnectionPool::~DatabaseConnectionPool() {
+
+	for (DatabaseCommandInterface* database : connections) {
+		delete database;
+	}
+	pthread_cond_destroy(&idle_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int DatabaseConnectionPool::open(MySQLDatabaseDriver databaseDriver,
+		std::string server_url, std::string server_username,
+		std::string server_password, std::string server_database,
+		unsigned int size) {
+
+	if (interactions.start(databaseDriver, server_url, server_username,
+			server_password, server_database) != 0) {
+		return -2;
+	}
+	for (unsigned int i = 0; i < size; i++) {
+		DatabaseCommandInterface* database = new DatabaseCommandInterface(
+				databaseDriver, server_url, server_username, server_password,
+				server_database);
+		if (!database->isConnected()) {
+			delete database;
+			return -2;
+		}
+		database->useSessionTable(&sessions);
+		database->useInteractionLog(&interactions);
+		database->useWallCache(&walls);
+		database->useUserDirectory(&directory);
+		if (i == 0 && database->refreshUsers() != 0) {
+			delete database;
+			return -2;
+		}
+		pthread_mutex_lock(&lock);
+		connections.push_back(database);
+		idle.push_back({database, std::chrono::steady_clock::now(), false});
+		pthread_mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+DatabaseCommandInterface* DatabaseConnectionPool::checkout(void) {
+
+	auto start = std::chrono::steady_clock::now();
+	idleConnection entry;
+	bool waited = false;
+	bool reconnected = false;
+
+	pthread_mutex_lock(&lock);
+	while (idle.empty()) {
+		waited = true;
+		pthread_cond_wait(&idle_cond, &lock);
+	}
+	entry = idle.back();
+	idle.pop_back();
+	pthread_mutex_unlock(&lock);
+
+	auto now = std::chrono::steady_clock::now();
+	unsigned long wait_us = std::chrono::duration_cast<
+			std::chrono::microseconds>(now - start).count();
+
+	//the ping costs a round trip, so only connections that may be stale get one
+	if (entry.failed
+			|| now - entry.returned >= std::chrono::seconds(check_interval)) {
+		if (!entry.database->isConnected()) {
+			std::cout << "Database pool: connection lost, reconnecting"
+					<< std::endl;
+			//a connection that can't be reopened stays in the pool, its queries report server errors
+			if (entry.database->reconnect() == 0) {
+				reconnected = true;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	stat_checkouts++;
+	if (waited) {
+		stat_waits++;
+	}
+	if (reconnected) {
+		stat_reconnects++;
+	}
+	stat_wait_total_us += wait_us;
+	if (wait_us > stat_wait_max_us) {
+		stat_wait_max_us = wait_us;
+	}
+	if (now - stat_reported >= std::chrono::seconds(stats_interval)) {
+		std::cout << "Database pool: " << stat_checkouts << " checkouts, "
+				<< stat_waits << " waited, wait avg "
+				<< stat_wait_total_us / stat_checkouts << " us max "
+				<< stat_wait_max_us << " us, " << stat_reconnects
+				<< " reconnects" << std::endl;
+		stat_reported = now;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return entry.database;
+}
+
+void DatabaseConnectionPool::checkin(DatabaseCommandInterface* database,
+		bool failed) {
+
+	pthread_mutex_lock(&lock);
+	idle.push_back({database, std::chrono::steady_clock::now(), failed});
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+SessionTable* DatabaseConnectionPool::sessionTable(void) {
+
+	return &sessions;
+}
+
+void DatabaseConnectionPool::close(void) {
+
+	interactions.stop();
+}
+
 DatabaseNotificationInterface::DatabaseNotificationInterface(
 		MySQLDatabaseDriver databaseDriver, std::string server_url,
 		std::string server_username, std::string server_password,
@@ -613,44 +1591,40 @@ DatabaseNotificationInterface::DatabaseNotificationInterface(
 
 DatabaseNotificationInterface::~DatabaseNotificationInterface() {
 
-	if (notifications_generated == true) {
-		//garbage collection
-		delete pstmt_get_notifications;
-		delete res_get_notifications;
-	}
+	flushRead();
+	statements.clear();
 	delete con;
 }
 
-int DatabaseNotificationInterface::getNotifications(void) {
+void DatabaseNotificationInterface::useSessionTable(SessionTable* sessions) {
 
-	if (notifications_generated == true) {
-		//garbage collection
-		delete pstmt_get_notifications;
-		delete res_get_notifications;
-	} else {
-		notifications_generated = true;
+	this->sessions = sessions;
+}
+
+void DatabaseNotificationInterface::setShard(unsigned int shard,
+		unsigned int shards) {
+
+	this->shard = shard;
+	this->shards = shards;
+}
+
+int DatabaseNotificationInterface::getOnlineUsers(
+		std::unordered_map<unsigned int, unsigned int>& sockets) {
+
+	if (sessions != NULL) {
+		sessions->onlineUsers(sockets);
+		return 0;
 	}
 	try {
-		pstmt_get_notifications =
-				con->prepareStatement(
-						"select OnlineUsers.socketDescriptor, Notifications.notificationID, "
-								"Posts.content, Posts.timestamp, Poster.userName poster, Postee.userName postee "
-								"from (select IntLog2.userID, IntLog1.socketDescriptor from "
-								"(select userID, max(timestamp) maxTimestamp from InteractionLog group by userID) IntLog2 join "
-								"(select userID, timestamp, logout, socketDescriptor from InteractionLog) IntLog1 "
-								"on IntLog1.userID = IntLog2.userID "
-								"and IntLog1.timestamp = IntLog2.maxTimestamp "
-								"where logout <>1 "
-								"and ADDTIME(TIMESTAMP, CONCAT('00:', ? ,':00')) > NOW()) OnlineUsers "
-								"join Notifications on OnlineUsers.userID = Notifications.userID "
-								"join Posts on Posts.postID = Notifications.postID "
-								"join Users Poster on Poster.userID = Posts.posterUserID "
-								"join Users Postee on Postee.userID = Posts.posteeUserID "
-								"where Notifications.readFlag = 0");
-		pstmt_get_notifications->setUInt(1, session_timeout);
-		res_get_notifications = pstmt_get_notifications->executeQuery();
-
-		return res_get_notifications->rowsCount();
+		sockets.clear();
+		pstmt = statements.get(con, QUERY_ONLINE_USERS);
+		pstmt->setUInt(1, session_timeout);
+		res = pstmt->executeQuery();
+		while (res->next()) {
+			sockets[res->getUInt("userID")] = res->getUInt("socketDescriptor");
+		}
+		delete res;
+		return 0;
 
 	} catch (sql::SQLException &e) {
 		std::cout << "# ERR: SQLException in " << __FILE__;
@@ -666,23 +1640,30 @@ int DatabaseNotificationInterface::getNotifications(void) {
 	return -2;
 }
 
-int DatabaseNotificationInterface::next(void) {
+int DatabaseNotificationInterface::getCursor(unsigned int user_id,
+		unsigned int* last_post_id) {
 
-	if (notifications_generated == false) {
-		//can't run function until notifications are generated
-		return -2;
+	auto it = cursors.find(user_id);
+	if (it != cursors.end()) {
+		*last_post_id = it->second;
+		return 0;
 	}
 	try {
-		if (res_get_notifications->isLast()) {
-			//reached end of notifications
-			delete pstmt_get_notifications;
-			delete res_get_notifications;
-			notifications_generated = false;
+		pstmt = statements.get(con, QUERY_GET_CURSOR);
+		pstmt->setUInt(1, user_id);
+		res = pstmt->executeQuery();
+
+		if (res->rowsCount() != 1) {
+			//not logged in since the cursors were added
+			delete res;
 			return -1;
-		} else {
-			res_get_notifications->next();
-			return res_get_notifications->getRow();
 		}
+		res->first();
+		*last_post_id = res->getUInt("lastPostID");
+		cursors[user_id] = *last_post_id;
+
+		delete res;
+		return 0;
 
 	} catch (sql::SQLException &e) {
 		std::cout << "# ERR: SQLException in " << __FILE__;
@@ -698,20 +1679,24 @@ int DatabaseNotificationInterface::next(void) {
 	return -2;
 }
 
-int DatabaseNotificationInterface::sendNotification(struct packet& pkt) {
+int DatabaseNotificationInterface::fetchPosts(unsigned int after,
+		unsigned int limit) {
+
+	int fetched = 0;
 
-	if (notifications_generated == false) {
-		//can't run function until notifications are generated
-		return -2;
-	}
 	try {
-		pkt.cmd_code = NOTIFY;
-		pkt.contents.rcvd_cnts = wall_entry_format(
-				res_get_notifications->getString("timestamp"),
-				res_get_notifications->getString("poster"),
-				res_get_notifications->getString("postee"),
-				res_get_notifications->getString("content"));
-		return res_get_notifications->getInt("socketDescriptor");
+		pstmt = statements.get(con, QUERY_NEW_POSTS);
+		pstmt->setUInt(1, after);
+		pstmt->setUInt(2, limit);
+		res = pstmt->executeQuery();
+		while (res->next()) {
+			posts.push_back({res->getUInt("postID"), res->getString("timestamp"),
+					res->getString("poster"), res->getString("postee"),
+					res->getString("content")});
+			fetched++;
+		}
+		delete res;
+		return fetched;
 
 	} catch (sql::SQLException &e) {
 		std::cout << "# ERR: SQLException in " << __FILE__;
@@ -727,25 +1712,208 @@ int DatabaseNotificationInterface::sendNotification(struct packet& pkt) {
 	return -2;
 }
 
-int DatabaseNotificationInterface::markRead(void) {
+int DatabaseNotificationInterface::getNotifications(void) {
+
+	std::unordered_map<unsigned int, unsigned int> sockets;
+	std::vector<std::pair<unsigned int, unsigned int> > users; // cursor, user id
+	unsigned int end = 0, last_post_id; // posts holds every post in (first cursor, end]
+	bool newest = false; // end is the newest post
+	int ret, fetched;
+	auto post_after = [](unsigned int post_id, const post& p) {
+		return post_id < p.post_id;
+	};
+
+	notifications_generated = true;
+	notifications.clear();
+	posts.clear();
+	behind.clear();
+	current = 0;
+
+	if (getOnlineUsers(sockets) < 0) {
+		return -2;
+	}
+	for (auto& user : sockets) {
+		if (user.first % shards != shard) {
+			//delivered by another notification thread
+			continue;
+		}
+		ret = getCursor(user.first, &last_post_id);
+		if (ret == -2) {
+			return -2;
+		}
+		if (ret == 0) {
+			users.push_back(std::make_pair(last_post_id, user.first));
+		}
+	}
+	if (users.empty()) {
+		return 0;
+	}
+
+	//a page of posts past each cursor, lowest cursor first so each page continues from the last post fetched
+	std::sort(users.begin(), users.end());
+	for (auto& user : users) {
+		if (user.first >= end) {
+			if (newest) {
+				continue;
+			}
+			end = user.first;	//no cursor left below it, skip the posts in between
+		}
+		size_t have = posts.end() - std::upper_bound(posts.begin(), posts.end(),
+				user.first, post_after);
+		if (have >= NOTIFICATION_POST_BATCH || newest) {
+			continue;
+		}
+		fetched = fetchPosts(end, NOTIFICATION_POST_BATCH - have);
+		if (fetched < 0) {
+			return -2;
+		}
+		if ((size_t) fetched < NOTIFICATION_POST_BATCH - have) {
+			newest = true;
+		}
+		if (fetched > 0) {
+			end = posts.back().post_id;
+		}
+	}
+
+	//by user, then by post
+	for (auto& user : users) {
+		std::swap(user.first, user.second);
+	}
+	std::sort(users.begin(), users.end());
+	for (auto& user : users) {
+		size_t i = std::upper_bound(posts.begin(), posts.end(), user.second,
+				post_after) - posts.begin();
+		size_t remaining = posts.size() - i;
+		if (remaining > NOTIFICATION_POST_BATCH
+				|| (remaining == NOTIFICATION_POST_BATCH && !newest)) {
+			//the rest once the client acknowledged these
+			behind.push_back(user.first);
+		}
+		for (size_t n = 0; i < posts.size() && n < NOTIFICATION_POST_BATCH; i++, n++) {
+			notifications.push_back({sockets[user.first], user.first, i});
+		}
+	}
+	return notifications.size();
+}
+
+bool DatabaseNotificationInterface::hasMorePosts(unsigned int user_id) {
+
+	return std::binary_search(behind.begin(), behind.end(), user_id);
+}
+
+int DatabaseNotificationInterface::next(void) {
 
 	if (notifications_generated == false) {
 		//can't run function until notifications are generated
 		return -2;
 	}
+	if (current >= notifications.size()) {
+		//reached end of notifications
+		notifications_generated = false;
+		return -1;
+	}
+	current++;
+	return current;
+}
+
+int DatabaseNotificationInterface::sendNotification(struct packet& pkt) {
+
+	if (notifications_generated == false || current == 0) {
+		//can't run function until notifications are generated
+		return -2;
+	}
+	const post& p = posts[notifications[current - 1].post];
+	pkt.cmd_code = NOTIFY;
+	pkt.contents.rcvd_cnts = wall_entry_format(p.timestamp, p.poster, p.postee,
+			p.content);
+	return notifications[current - 1].socket_descriptor;
+}
+
+int DatabaseNotificationInterface::markRead(void) {
+
+	if (notifications_generated == false || current == 0) {
+		//can't run function until notifications are generated
+		return -2;
+	}
+	if (markRead(notifications[current - 1].user_id,
+			posts[notifications[current - 1].post].post_id) < 0) {
+		return -2;
+	}
+	return current;
+}
+
+int DatabaseNotificationInterface::getUserID(void) {
+
+	if (notifications_generated == false || current == 0) {
+		//can't run function until notifications are generated
+		return -2;
+	}
+	return notifications[current - 1].user_id;
+}
+
+int DatabaseNotificationInterface::getPostID(void) {
+
+	if (notifications_generated == false || current == 0) {
+		//can't run function until notifications are generated
+		return -2;
+	}
+	return posts[notifications[current - 1].post].post_id;
+}
+
+int DatabaseNotificationInterface::markRead(unsigned int user_id,
+		unsigned int post_id) {
+
+	//sent again only after a restart that lost the unwritten cursors
+	if (cursors[user_id] < post_id) {
+		cursors[user_id] = post_id;
+	}
+	if (unwritten_reads.empty()) {
+		first_unwritten = std::chrono::steady_clock::now();
+	}
+	if (unwritten_reads[user_id] < post_id) {
+		unwritten_reads[user_id] = post_id;
+	}
+	if (unwritten_reads.size() >= NOTIFICATION_READ_BATCH) {
+		return flushRead();
+	}
+	return 0;
+}
+
+bool DatabaseNotificationInterface::readsUnwritten(void) {
+
+	return !unwritten_reads.empty();
+}
+
+int DatabaseNotificationInterface::flushRead(bool force) {
+
+	if (unwritten_reads.empty()) {
+		return 0;
+	}
+	if (!force && unwritten_reads.size() < NOTIFICATION_READ_BATCH
+			&& std::chrono::steady_clock::now() - first_unwritten
+					< std::chrono::seconds(read_flush_interval)) {
+		return 0;
+	}
 	try {
-		pstmt_mark_read = con->prepareStatement("update Notifications "
-				"set readFlag = 1 "
-				"where notificationID = ?");
-		pstmt_mark_read->setUInt(1,
-				res_get_notifications->getUInt("notificationID"));
-		if (pstmt_mark_read->executeUpdate() != 1) {
-			delete pstmt_mark_read;
-			return -2;
+		pstmt = statements.get(con, QUERY_ADVANCE_CURSORS);
+		auto it = unwritten_reads.begin();
+		while (it != unwritten_reads.end()) {
+			auto batch = it;
+			for (int i = 0; i < NOTIFICATION_READ_BATCH; i++) {
+				//a short batch repeats its last row, greatest() makes that harmless
+				pstmt->setUInt(2 * i + 1, batch->first);
+				pstmt->setUInt(2 * i + 2, batch->second);
+				if (std::next(batch) != unwritten_reads.end()) {
+					batch++;
+				}
+			}
+			pstmt->executeUpdate();
+			//only forget cursors once they are written, a failed batch is retried by the next flush
+			for (int i = 0; i < NOTIFICATION_READ_BATCH && it != unwritten_reads.end(); i++) {
+				it = unwritten_reads.erase(it);
+			}
 		}
-
-		delete pstmt_mark_read;
-		return res_get_notifications->getRow();
+		return 0;
 
 	} catch (sql::SQLException &e) {
 		std::cout << "# ERR: SQLException in " << __FILE__;
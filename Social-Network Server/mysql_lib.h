@@ -7,6 +7,16 @@
 #include <climits>
 #include <cstdlib>
 #include <math.h>
+#include <pthread.h>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 
 #include "mysql_connection.h"
 #include <cppconn/driver.h>
@@ -18,10 +28,268 @@
 #include "structures.h"
 using namespace std;
 
+#define NOTIFICATION_READ_BATCH 16 // cursors written by one statement, must match QUERY_ADVANCE_CURSORS
+#define NOTIFICATION_POST_BATCH 128 // most posts past a user's cursor one round of notifications sends
+#define INTERACTION_LOG_BATCH 16 // rows inserted by one statement, must match QUERY_INSERT_INTERACTIONS
+#define WALL_PAGE_POSTS 50 // most posts in one page of a wall
+#define WALL_PAGE_BYTES 3584 // most bytes of posts in one page, a SHOW frame (MAX_PACKET_LEN) less room for the header
+
 string wall_entry_format(string timestamp, string poster, string postee,
 		string content);
 //formats wall entry consistently across classes
 
+enum queryID {
+	QUERY_VALID_SESSION,
+	QUERY_LOGIN,
+	QUERY_SESSION_EXISTS,
+	QUERY_LIST_USERS,
+	QUERY_WALL,
+	QUERY_INSERT_POST,
+	QUERY_LAST_INSERT_ID,
+	QUERY_INIT_CURSOR,
+	QUERY_USER_NAME,
+	QUERY_INSERT_INTERACTION,
+	QUERY_USER_ID,
+	QUERY_ONLINE_USERS,
+	QUERY_GET_CURSOR,
+	QUERY_NEW_POSTS,
+	QUERY_ADVANCE_CURSORS,
+	QUERY_INSERT_INTERACTIONS,
+	QUERY_INSERT_POST_BY_ID,
+	QUERY_COUNT
+};
+//ids of the queries in the statement registry (query_text in mysql_lib.cpp), add new queries before QUERY_COUNT
+
+class PreparedStatementCache {
+	/*
+	 * Prepared statements of one connection, prepared the first time a query is used
+	 * and reused by later calls instead of being prepared and deleted each time.
+	 * Result sets are still owned (and deleted) by the caller.
+	 *
+	 * Thread safety: belongs to the connection, same as its owner
+	 */
+public:
+	PreparedStatementCache();
+	~PreparedStatementCache();
+
+	sql::PreparedStatement* get(sql::Connection* con, queryID id);
+	/*
+	 * Returns the statement of query id on con, preparing it if it isn't cached yet.
+	 * Throws sql::SQLException if it can't be prepared.
+	 */
+
+	void clear(void);
+	/*
+	 * Deletes every cached statement. Must be called before the connection they
+	 * were prepared on is deleted or replaced.
+	 */
+
+private:
+	sql::PreparedStatement* statements[QUERY_COUNT];
+};
+
+class SessionTable {
+	/*
+	 * In-memory copy of the open sessions (session id -> user id, socket, last activity)
+	 * so checking a session doesn't query InteractionLog. Entries are added on login,
+	 * refreshed by every interaction logged for the session and closed on logout.
+	 * Entries are removed once they expire. InteractionLog stays the durable record:
+	 * sessions missing here (e.g. opened before a server restart) are looked up there
+	 * and added back. Closed sessions are kept until they expire, their logout row may
+	 * still be queued and not in InteractionLog yet.
+	 *
+	 * Thread safety: can be used from any thread, the table is split in shards each
+	 * guarded by its own lock
+	 */
+public:
+	unsigned int session_timeout = 15; // in minutes between 0 and 59. Should be set the same as DatabaseCommandInterface
+
+	SessionTable();
+	~SessionTable();
+
+	int lookup(unsigned int session_id, unsigned int* user_id = NULL,
+			unsigned int* socket_descriptor = NULL);
+	/*
+	 * Finds an unexpired session and passes back its user_id and socket_descriptor
+	 * if supplied with pointers. Expired sessions found are removed.
+	 *
+	 * Returns 0 if found, returns -1 if the session isn't in the table or expired,
+	 * returns -2 if the session was logged out
+	 */
+
+	void update(unsigned int session_id, bool logout, unsigned int user_id,
+			unsigned int socket_descriptor);
+	/*
+	 * Records an interaction of the session: adds or refreshes it, or closes it on logout
+	 */
+
+	void onlineUsers(std::unordered_map<unsigned int, unsigned int>& sockets);
+	/*
+	 * Passes back the users with an unexpired session (user id -> socket descriptor of
+	 * the user's most recently active session)
+	 */
+
+private:
+	static const int SHARDS = 64;
+
+	struct sessionEntry {
+		unsigned int user_id;
+		unsigned int socket_descriptor;
+		std::chrono::steady_clock::time_point last_activity;
+		bool logout;
+	};
+
+	struct shard {
+		pthread_mutex_t lock;
+		std::unordered_map<unsigned int, sessionEntry> sessions;
+		std::chrono::steady_clock::time_point last_sweep;
+	};
+
+	shard shards[SHARDS];
+};
+
+class WallCache {
+	/*
+	 * In-memory copy of wall pages as showWall formats them (rcvd_cnts and the next
+	 * page), so showing a wall again doesn't query or format it. Pages are keyed by
+	 * wall owner, before and limit. A new post only changes the newest page of its
+	 * wall (before 0), older pages stay valid: postOnWall invalidates the newest pages
+	 * of the wall, and a page read from the database while a post was made isn't kept.
+	 *
+	 * The least recently used pages are dropped once the pages and the generations of
+	 * the walls posted on take more than max_bytes.
+	 * Hits, misses and evictions are printed every stats_interval.
+	 *
+	 * Thread safety: can be used from any thread, guarded by one lock
+	 */
+public:
+	size_t max_bytes = 16 * 1024 * 1024;
+	unsigned int stats_interval = 60; // in seconds between printing the statistics
+
+	WallCache();
+	~WallCache();
+
+	int lookup(const std::string& owner, unsigned int before, unsigned int limit,
+			std::string* page, unsigned int* next, unsigned int* latest,
+			unsigned long* generation);
+	/*
+	 * Finds a page and passes back its contents, next page and newest post. On a miss, passes back
+	 * the generation of the wall to give to insert once the page is read.
+	 *
+	 * Returns 0 if found, returns -1 if not
+	 */
+
+	void insert(const std::string& owner, unsigned int before, unsigned int limit,
+			unsigned long generation, const std::string& page, unsigned int next,
+			unsigned int latest);
+	/*
+	 * Keeps a page read from the database, unless the wall was invalidated since
+	 * generation was looked up
+	 */
+
+	void invalidate(const std::string& owner);
+	/*
+	 * Drops the newest pages of the wall, call once a post on it is made
+	 */
+
+private:
+	struct wallPage {
+		std::string key;
+		std::string owner;
+		bool newest; // before was 0, changes with every post
+		unsigned long generation;
+		std::string page;
+		unsigned int next;
+		unsigned int latest;
+	};
+
+	pthread_mutex_t lock;
+	std::list<wallPage> pages; // most recently used first
+	std::unordered_map<std::string, std::list<wallPage>::iterator> index;
+	std::unordered_map<std::string, unsigned long> generations; // posts made on each wall posted on, none is 0
+	size_t bytes = 0; // pages and generations
+
+	unsigned long stat_hits = 0;
+	unsigned long stat_misses = 0;
+	unsigned long stat_evictions = 0;
+	std::chrono::steady_clock::time_point stat_reported;
+
+	void remove(std::list<wallPage>::iterator it);
+	/*
+	 * Drops a page, under lock
+	 */
+
+	unsigned long generation_of(const std::string& owner);
+	/*
+	 * Returns the posts made on the wall, 0 if none, under lock. Doesn't add an entry,
+	 * so names shown but never posted on take no memory
+	 */
+};
+
+class UserDirectory {
+	/*
+	 * In-memory copy of the Users table (name -> id, id -> name and the LIST response)
+	 * so request threads don't query it. The copy is an immutable snapshot: readers take
+	 * the current one without locking, a refresh builds a new one from the database and
+	 * swaps it in, and the old one is freed once its last reader lets go of it.
+	 *
+	 * A snapshot is read again once it is refresh_interval old, or at most every
+	 * miss_interval when a name isn't found in it (e.g. a user added since). The version
+	 * of the snapshot is a hash of its LIST response: it only changes when the list did,
+	 * and stays the same across restarts.
+	 *
+	 * Thread safety: can be used from any thread
+	 */
+public:
+	unsigned int refresh_interval = 30; // in seconds a snapshot is used before the table is read again
+	unsigned int miss_interval = 1; // in seconds between reads of the table for names not found
+
+	struct snapshot {
+		std::string version; // list_version of list
+		std::chrono::steady_clock::time_point loaded;
+		std::unordered_map<std::string, unsigned int> ids; // by user_name_key()
+		std::unordered_map<unsigned int, std::string> names;
+		std::string list; // rcvd_cnts of LIST
+	};
+
+	UserDirectory();
+
+	std::shared_ptr<const snapshot> current(void);
+	/*
+	 * Returns the current snapshot, NULL before the first refresh
+	 */
+
+	bool claimRefresh(const std::shared_ptr<const snapshot>& seen, bool missed);
+	/*
+	 * Decides whether the caller, having the snapshot seen, should read the table
+	 * again: it is too old, or missed a name and wasn't read for miss_interval.
+	 * Only one caller is told to at a time and must then call publish or abandon.
+	 *
+	 * Returns true if the caller refreshes the directory
+	 */
+
+	void publish(const std::vector<std::pair<unsigned int, std::string> >& users);
+	/*
+	 * Swaps in a snapshot of the given users (id, name) in the order LIST shows them
+	 */
+
+	void abandon(void);
+	/*
+	 * Gives up a claimed refresh (e.g. the table couldn't be read)
+	 */
+
+private:
+	std::shared_ptr<const snapshot> users;
+	std::atomic<bool> refreshing;
+	std::chrono::steady_clock::time_point tried; // last refresh, under refreshing
+};
+
+std::string user_name_key(const std::string& user_name);
+//user name as the Users table compares it: case insensitive, without trailing spaces
+
+std::string list_version(const std::string& list);
+//version of a LIST response: a hash of it, the same for the same list across restarts
+
 class MySQLDatabaseDriver {
 	/*
 	 * Call this once in the global space to initialize the MySQLDriver
@@ -33,6 +301,99 @@ public:
 	~MySQLDatabaseDriver();
 };
 
+class InteractionLogWriter {
+	/*
+	 * Writes InteractionLog rows on its own thread and connection, so a request
+	 * doesn't wait for its row to be inserted and committed before it is answered.
+	 * Rows are queued with the time of the interaction and written in one transaction
+	 * per flush, INTERACTION_LOG_BATCH rows per insert, once a batch is full or the
+	 * oldest row has waited flush_interval. Rows that can't be written stay queued
+	 * and are retried.
+	 *
+	 * The queue holds max_queued rows, add() waits for room beyond that. The queue lag
+	 * (time from add() to commit) is printed with the row counts every stats_interval.
+	 *
+	 * Thread safety: add() can be called from any thread
+	 */
+public:
+	unsigned int flush_interval = 100; // in milliseconds a row can wait for its batch to fill
+	unsigned int max_queued = 4096; // rows
+	unsigned int stats_interval = 60; // in seconds between printing the queue statistics
+
+	InteractionLogWriter();
+	~InteractionLogWriter();
+
+	int start(MySQLDatabaseDriver databaseDriver, std::string server_url,
+			std::string server_username, std::string server_password,
+			std::string server_database);
+	/*
+	 * Opens the connection of the writer and starts its thread. Call once.
+	 *
+	 * Returns 0 if successful, returns -2 if server error
+	 */
+
+	int add(unsigned int user_id, unsigned int session_id, bool logout,
+			unsigned int socket_descriptor, std::string command);
+	/*
+	 * Queues a row of InteractionLog, waiting while the queue is full.
+	 *
+	 * Returns 0 if queued, returns -1 if the writer isn't running
+	 */
+
+	void stop(void);
+	/*
+	 * Writes the rows still queued and stops the thread. Rows added afterwards are refused.
+	 */
+
+private:
+	struct interaction {
+		unsigned int user_id;
+		unsigned int session_id;
+		bool logout;
+		unsigned int socket_descriptor;
+		std::string command;
+		std::string timestamp; // when add() was called, in the server's time zone
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	sql::Driver* driver;
+	sql::Connection* con = NULL;
+	std::string server_url;
+	std::string server_username;
+	std::string server_password;
+	std::string server_database;
+	PreparedStatementCache statements;
+	sql::PreparedStatement* pstmt;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued_cond; // wakes the writer thread
+	pthread_cond_t room_cond; // wakes add() waiting for room
+	std::deque<interaction> queue;
+	bool running = false;
+	bool stopping = false;
+
+	unsigned long stat_rows = 0;
+	unsigned long stat_commits = 0;
+	unsigned long stat_full_waits = 0;
+	unsigned long stat_lag_total_ms = 0;
+	unsigned long stat_lag_max_ms = 0;
+	std::chrono::steady_clock::time_point stat_reported;
+	/* queue statistics, under lock */
+
+	static void* run(void* writer);
+	/*
+	 * Body of the writer thread
+	 */
+
+	int write(std::vector<interaction>& rows);
+	/*
+	 * Inserts the rows in one transaction, reconnecting first if the last write failed.
+	 *
+	 * Returns 0 if committed, returns -2 if server error (nothing was written)
+	 */
+};
+
 class DatabaseCommandInterface {
 	/*
 	 * Call this in each client handler thread that needs to connect to the database.
@@ -54,6 +415,51 @@ public:
 	 * Used for testing
 	 */
 
+	bool isConnected(void);
+	/*
+	 * Checks that the connection to the server is open and answers a ping.
+	 *
+	 * Returns true if it can be used, false otherwise
+	 */
+
+	int reconnect(void);
+	/*
+	 * Opens a new connection to the server with the parameters given to the constructor
+	 * and replaces the current one with it. The current connection is kept if the
+	 * new one can't be opened.
+	 *
+	 * Returns 0 if successful, returns -2 if server error
+	 */
+
+	void useSessionTable(SessionTable* sessions);
+	/*
+	 * Checks sessions in the given table before querying the database and keeps
+	 * it up to date with the interactions logged. Without one every check queries the database.
+	 */
+
+	void useWallCache(WallCache* walls);
+	/*
+	 * Answers showWall from the given cache when it can and keeps it up to date with the posts made
+	 */
+
+	void useUserDirectory(UserDirectory* directory);
+	/*
+	 * Looks users up in the given directory instead of querying the Users table
+	 */
+
+	int refreshUsers(void);
+	/*
+	 * Reads the Users table into the user directory, once before it is first used
+	 *
+	 * Returns 0 if successful, returns -2 if server error
+	 */
+
+	void useInteractionLog(InteractionLogWriter* writer);
+	/*
+	 * Queues the interactions on the given writer instead of inserting them before returning.
+	 * Requires a session table, the sessions are checked there before the rows are written.
+	 */
+
 	/*
 	 * the following functions take the request packet input, perform SQL queries and then overwrite the request
 	 * packet with the corresponding response packet. They return 0 if successful and
@@ -66,6 +472,7 @@ public:
 	 * This function checks if the session in the packet is valid based on session_timeout
 	 * and logout status. If the session is valid and variables are passed in,
 	 * the function can return the user_id and socket_descriptor associated with the session.
+	 * The session table is checked first if one is used, the database only on a miss.
 	 *
 	 * returns:
 	 * 0 if valid
@@ -81,10 +488,10 @@ public:
 	 * If server error, writes an error message to received contents and returns -2.
 	 */
 
-	int listUsers(struct packet& pkt);
+	int listUsers(struct packet& pkt, std::string* version = NULL);
 	/*
 	 * Queries database for list of all users. Writes numbered list of users
-	 * with newlines between users to rcvd_cnts.
+	 * with newlines between users to rcvd_cnts, and its version (list_version) if supplied with a pointer.
 	 * Ex:
 	 * 1. alice
 	 * 2. bob
@@ -92,10 +499,17 @@ public:
 	 * Returns 0 if successful, or -2 if server error and writes error message to rcvd_cnts
 	 */
 
-	int showWall(struct packet& pkt);
+	int showWall(struct packet& pkt, unsigned int before, unsigned int limit,
+			unsigned int* next, unsigned int* latest, bool log = true);
 	/*
-	 * Queries database for list of posts on a user's wall. Writes a formatted
-	 * string of posts to rcvd_cnts.
+	 * Queries database for one page of the posts on a user's wall, newest first:
+	 * up to limit (at most WALL_PAGE_POSTS) posts older than post before, or the newest
+	 * posts if before is 0. Writes a formatted string of the posts to rcvd_cnts, no more
+	 * than fit in WALL_PAGE_BYTES, the before of the next page to next (0 if none) and
+	 * the id of its newest post to latest (0 if none). Posts are never changed, so
+	 * latest identifies the contents of the page: it is the version of the page.
+	 * The interaction is logged unless log is false (e.g. the pages after the first of a stream).
+	 * Pages in the wall cache, if one is used, are answered from it without querying the database.
 	 * Ex:
 	 * timestamp - Alice posted on Bob's wall
 	 * Oh my god! Politics!
@@ -129,7 +543,16 @@ public:
 
 private:
 	sql::Driver* driver;
-	sql::Connection* con;
+	sql::Connection* con = NULL;
+	std::string server_url;
+	std::string server_username;
+	std::string server_password;
+	std::string server_database;
+	PreparedStatementCache statements;
+	SessionTable* sessions = NULL;
+	InteractionLogWriter* interactions = NULL;
+	WallCache* walls = NULL;
+	UserDirectory* directory = NULL;
 	sql::Statement* stmt;
 	sql::PreparedStatement* pstmt;
 	sql::ResultSet* res;
@@ -148,31 +571,124 @@ private:
 	/*
 	 * Used for updating InteractionLog
 	 *
-	 * Should only be called after existing statements, prepared statements,
-	 * or result sets have been deleted as this modifies the private prepared statement
-	 * and result set variables. Creates own prepared statements for updating database.
+	 * Should only be called after existing result sets have been deleted as this
+	 * modifies the private prepared statement and result set variables.
 	 *
 	 * Returns 0 if successful, returns -2 if unintended SQL behavior/server error
 	 */
 
+	std::shared_ptr<const UserDirectory::snapshot> getUsers(bool missed = false);
+	/*
+	 * Returns the current snapshot of the user directory, refreshing it first if it is
+	 * due (missed: a name wasn't found in the snapshot last returned). NULL if none was read.
+	 */
+
+	int getUserName(unsigned int user_id, std::string* user_name);
+	/*
+	 * Passes back the name of a user
+	 *
+	 * Returns 0 if found, returns -1 if the user doesn't exist, returns -2 if server error
+	 */
+
 	int getUserID(std::string user_name, unsigned int* user_id = NULL);
 	/*
 	 * Used for checking if a user exists in the database. Passes userID back if supplied with pointer
 	 *
-	 * Should only be called after existing statements, prepared statements,
-	 * or result sets have been deleted as this modifies the private prepared statement
-	 * and result set variables. Creates own prepared statements for querying database.
+	 * Should only be called after existing result sets have been deleted as this
+	 * modifies the private prepared statement and result set variables.
 	 *
 	 * Returns 0 if user exists, returns -1 if user doesn't exist, returns -2 if unintended SQL behavior/server error
 	 */
 };
 
+class DatabaseConnectionPool {
+	/*
+	 * A fixed set of DatabaseCommandInterface connections shared by the client
+	 * handler threads and workers. A thread checks a connection out for the
+	 * queries of one request and checks it back in, waiting if all of them are
+	 * in use. Connections are checked (and reopened if the server dropped them)
+	 * before being handed out when they failed or sat idle for a while.
+	 *
+	 * Thread safety: checkout() and checkin() can be called from any thread
+	 */
+public:
+	unsigned int check_interval = 30; // in seconds a connection can sit idle before it is checked again
+	unsigned int stats_interval = 60; // in seconds between printing the wait statistics
+
+	DatabaseConnectionPool();
+	~DatabaseConnectionPool();
+
+	int open(MySQLDatabaseDriver databaseDriver, std::string server_url,
+			std::string server_username, std::string server_password,
+			std::string server_database, unsigned int size);
+	/*
+	 * Opens size connections to the server. Call once before any checkout.
+	 *
+	 * Returns 0 if successful, returns -2 if a connection couldn't be opened
+	 */
+
+	DatabaseCommandInterface* checkout(void);
+	/*
+	 * Takes a connection from the pool, waiting until one is checked in if all are in use.
+	 * The connection belongs to the calling thread until it is checked in.
+	 */
+
+	void checkin(DatabaseCommandInterface* database, bool failed = false);
+	/*
+	 * Returns a connection to the pool. failed marks it to be checked before
+	 * its next checkout (e.g. a query on it returned a server error).
+	 */
+
+	SessionTable* sessionTable(void);
+	/*
+	 * Returns the session table shared by the connections of the pool
+	 */
+
+	void close(void);
+	/*
+	 * Writes the interactions still queued. Call before exiting.
+	 */
+
+private:
+	struct idleConnection {
+		DatabaseCommandInterface* database;
+		std::chrono::steady_clock::time_point returned;
+		bool failed;
+	};
+
+	pthread_mutex_t lock;
+	pthread_cond_t idle_cond;
+	std::vector<DatabaseCommandInterface*> connections;
+	std::vector<idleConnection> idle; // most recently returned last, checked out first
+	SessionTable sessions; // shared by all the connections
+	InteractionLogWriter interactions; // InteractionLog rows of all the connections
+	WallCache walls; // wall pages shown through all the connections
+	UserDirectory directory; // users looked up through all the connections
+
+	unsigned long stat_checkouts = 0;
+	unsigned long stat_waits = 0;
+	unsigned long stat_wait_total_us = 0;
+	unsigned long stat_wait_max_us = 0;
+	unsigned long stat_reconnects = 0;
+	std::chrono::steady_clock::time_point stat_reported;
+	/* wait statistics, under lock */
+};
+
 class DatabaseNotificationInterface {
 	/*
 	 * The Notification object handles querying the database for notifications,
 	 * iterating through the notifications, generating a packet to send,
 	 * and updating the database if a notification is successfully sent to the client.
 	 *
+	 * Posts are stored once. Each user has a cursor (NotificationCursors.lastPostID)
+	 * and a notification is a post newer than the cursor of an online user, computed
+	 * when the notifications are queried.
+	 *
+	 * Querying is incremental: the cursors of online users are kept in memory, so only
+	 * posts newer than the oldest of them are fetched, and the online users come from
+	 * the session table when one is used. When every online user has caught up, a query
+	 * costs as much as the number of new posts, not the size of the tables.
+	 *
 	 * It requires a MySQLDatabaseDriver to have been initialized and passed to it.
 	 *
 	 * This object should only be used within the notifications thread
@@ -181,22 +697,42 @@ class DatabaseNotificationInterface {
 	 */
 public:
 	int session_timeout = 15; // in minutes between 0 and 59. Should be set the same across all threads
+	unsigned int read_flush_interval = 1; // in seconds a moved cursor can wait before it is written
 
 	DatabaseNotificationInterface(MySQLDatabaseDriver databaseDriver,
 			std::string server_url, std::string server_username,
 			std::string server_password, std::string server_database);
 	~DatabaseNotificationInterface();
 
+	void useSessionTable(SessionTable* sessions);
+	/*
+	 * Takes the online users from the given table instead of querying InteractionLog
+	 */
+
+	void setShard(unsigned int shard, unsigned int shards);
+	/*
+	 * Only generates notifications for users with user id % shards == shard, so that
+	 * several notification threads can each deliver to their own part of the users
+	 */
+
 	int getNotifications(void);
 	/*
 	 * queries the database for notifications to process. Returns the number of notifications
-	 * to process.
+	 * to process. They are ordered by user, then by post, oldest first. A user gets at most
+	 * NOTIFICATION_POST_BATCH posts past its cursor, a user that was away long catches up
+	 * a page per round instead of every round loading its whole backlog.
 	 *
 	 * Returns:
 	 * 0 or positive int if successful
 	 * -2 if server error
 	 */
 
+	bool hasMorePosts(unsigned int user_id);
+	/*
+	 * Returns true if the last getNotifications left posts for the user past its page,
+	 * to be generated by a round after the client acknowledged the page
+	 */
+
 	int next(void);
 	/*
 	 * Iterates the Notification object to the next entry. Returns the row number if the entry exists.
@@ -225,15 +761,119 @@ public:
 	 * -2 if server error
 	 */
 
+	int getUserID(void);
+	/*
+	 * Returns the userID the current notification is for.
+	 *
+	 * Returns:
+	 * userID if successful
+	 * -2 if server error
+	 */
+
+	int getPostID(void);
+	/*
+	 * Returns the postID of the current notification, to mark it read
+	 * after the iteration has moved on (e.g. once a windowed socket is flushed).
+	 *
+	 * Returns:
+	 * postID if successful
+	 * -2 if server error
+	 */
+
+	int markRead(unsigned int user_id, unsigned int post_id);
+	/*
+	 * Marks every post up to post_id as read by the user (acknowledged by client code)
+	 * by moving the user's notification cursor forward. The cursor moves in memory at once,
+	 * it is written to the database with others by flushRead, here once
+	 * NOTIFICATION_READ_BATCH users have unwritten cursors.
+	 *
+	 * Delivery is at least once: a cursor is only moved past posts the client acknowledged,
+	 * and posts whose cursor wasn't written yet are sent again after a restart.
+	 *
+	 * Returns:
+	 * 0 if successful.
+	 * -2 if server error (the cursors stay unwritten and are retried by the next flush)
+	 */
+
+	int flushRead(bool force = true);
+	/*
+	 * Writes the unwritten cursors to the database, in multi-row statements of
+	 * NOTIFICATION_READ_BATCH cursors. Without force, only does so once a batch is full
+	 * or the oldest unwritten cursor has waited read_flush_interval.
+	 *
+	 * Returns:
+	 * 0 if successful (or nothing to write yet).
+	 * -2 if server error
+	 */
+
+	bool readsUnwritten(void);
+	/*
+	 * Returns true if some cursors were moved but not written to the database yet
+	 */
+
 private:
 	sql::Driver* driver;
 	sql::Connection* con;
-	sql::PreparedStatement* pstmt_get_notifications;
-	sql::ResultSet* res_get_notifications;
-	sql::PreparedStatement* pstmt_mark_read;
+	PreparedStatementCache statements;
+	SessionTable* sessions = NULL;
+	unsigned int shard = 0;
+	unsigned int shards = 1;
+	sql::PreparedStatement* pstmt;
+	sql::ResultSet* res;
+
+	struct post {
+		unsigned int post_id;
+		std::string timestamp;
+		std::string poster;
+		std::string postee;
+		std::string content;
+	};
+
+	struct notification {
+		unsigned int socket_descriptor;
+		unsigned int user_id;
+		size_t post; // index in posts
+	};
+
+	std::unordered_map<unsigned int, unsigned int> cursors;
+	/* lastPostID of users seen online, only changed through markRead. Posts are
+	 * fetched a page past each of them
+	 */
+	std::map<unsigned int, unsigned int> unwritten_reads;
+	std::chrono::steady_clock::time_point first_unwritten;
+	/* cursors moved by markRead but not written yet (user id -> lastPostID) and when the
+	 * first of them was moved
+	 */
+	std::vector<post> posts;
+	std::vector<notification> notifications;
+	size_t current = 0;
+	std::vector<unsigned int> behind;
+	/* posts fetched by getNotifications, what to send to whom and the iteration
+	 * position (current - 1 is the current entry), users with posts left past their page (sorted)
+	 */
 	bool notifications_generated = false;
-	/* used for garbage collection of statements and result sets and to
-	 * ensure that functions aren't run on uncreated statements
+	/* ensures that functions aren't run before notifications are generated */
+
+	int getOnlineUsers(std::unordered_map<unsigned int, unsigned int>& sockets);
+	/*
+	 * Passes back the online users (user id -> socket descriptor), from the session table
+	 * if one is used, from InteractionLog otherwise.
+	 *
+	 * Returns 0 if successful, returns -2 if server error
+	 */
+
+	int getCursor(unsigned int user_id, unsigned int* last_post_id);
+	/*
+	 * Passes back the cursor of the user, read from the database the first time.
+	 *
+	 * Returns 0 if successful, returns -1 if the user has no cursor, returns -2 if server error
+	 */
+
+	int fetchPosts(unsigned int after, unsigned int limit);
+	/*
+	 * Appends to posts up to limit posts newer than post after, oldest first.
+	 *
+	 * Returns the number of posts fetched, returns -2 if server error
 	 */
 };
 
@@ -9,15 +9,77 @@
 #include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <poll.h>
 #include "structures.h"
 #include <pthread.h>
 #include <time.h>
 #include <chrono>
+#include <unordered_map>
+#include <deque>
 
 #define TIMEOUT_SEC 2
 #define LISTEN_QUEUE_LENGTH 15
 #define MAX_PACKET_LEN 4096
 #define ERR_LEN 256
+#define MAX_CONNECTIONS 65536
+#define RX_BUFFER_LEN (2 * MAX_PACKET_LEN)	//room for one whole frame plus the start of the next
+#define MAX_BUFFERED_PKTS 64	//requests per connection read by a thread waiting for its ACK
+#define DEFAULT_QUEUE_LEN 256	//packets enqueue_socket keeps per connection before the queue policy applies
+#define MAX_COALESCED_LEN (MAX_PACKET_LEN - 128)	//rcvd_cnts a coalesced packet may grow to, the rest is room for the header
+#define DRAIN_THREADS 8	//threads writing the queues of enqueue_socket, each socket a window at a time
+
+/*
+binary frame (all integers in network byte order):
+	uint8	magic		WIRE_MAGIC, never the first byte of a text frame ('c' of "content_len:")
+	uint8	version		WIRE_VERSION
+	uint16	flags		WIRE_FLAG_*, 0 if none
+	uint32	length		bytes of body following the header
+	uint32	cmd_code
+	uint32	req_num
+	uint32	sessionId
+body of an ACK frame: uint32 content_len of the acknowledged frame
+a frame flagged WIRE_FLAG_WINDOWED is not acknowledged on its own: the receiver counts them and answers
+with an ACK flagged WIRE_FLAG_CUMULATIVE whose req_num is the count received so far (body content_len 0)
+a frame flagged WIRE_FLAG_IMPLICIT is never acknowledged: its response (or TCP) is the acknowledgement
+body of any other frame: username, password, postee, post, wallOwner, rcvd_cnts in that order,
+each as uint32 length followed by the bytes
+*/
+#define WIRE_MAGIC 0xA5
+#define WIRE_VERSION 1
+#define WIRE_HEADER_LEN 20
+#define WIRE_FLAG_WINDOWED 0x0001
+#define WIRE_FLAG_CUMULATIVE 0x0002
+#define WIRE_FLAG_IMPLICIT 0x0004
+#define MAX_WINDOW 16	//most windowed frames a writer may have unacknowledged
+
+//capability strings exchanged in rcvd_cnts of LOGIN,
+//e.g. "OFFER wire=binary ack=window:16 ack=implicit" / "ACCEPT wire=binary ack=window:16 ack=implicit"
+#define WIRE_OFFER "OFFER"
+#define WIRE_ACCEPT "ACCEPT"
+
+//paging of SHOW in rcvd_cnts, newest post first, e.g. request "PAGE before=120 limit=20" / response "PAGE next=97 version=119\n<posts>"
+//a SHOW without it (old client) gets the whole wall streamed as several SHOW responses
+#define WALL_PAGE "PAGE"
+#define WALL_PAGE_LIMIT 20	//posts per page a client asks for by default
+
+//versions of LIST in rcvd_cnts, e.g. request "LIST version=0" / response "LIST version=8172\n<users>"
+//a LIST or SHOW page request carrying the version of the response it has gets "UNCHANGED version=8172" if it still is
+#define LIST_VERSION "LIST"
+#define UNCHANGED "UNCHANGED"
+
+enum wireModes {
+	WIRE_TEXT,
+	WIRE_BINARY
+};
+
+//what enqueue_socket does with a packet for a socket whose queue is full
+enum queuePolicies {
+	QUEUE_DROP_OLDEST,	//drop the oldest queued packet
+	QUEUE_DISCONNECT,	//drop the new packet and shut the connection down
+	QUEUE_COALESCE	//append the contents of a NOTIFY to the last queued one, drop the oldest if it does not fit
+};
 
 using namespace std;
 
@@ -60,24 +122,162 @@ int destroy_socket(int socketfd);
 /*
 send the pkt through the socket,
 this function will automatically set content_len for any packet & req_num field for request packet
+on a windowed socket it returns once the packet is written and waits only while the window is full,
+use flush_socket to know the packet arrived; with implicit ACKs only NOTIFY is windowed, anything else is not acknowledged
 return 0 if success
 return -1 if error happened in the write() funciton
 return -2 if failed to read ACK packet
 return -3 if data in ACK packet does not match sent packet
+return -4 if the socket's queue of buffered requests is full
 */
 int write_socket(int socketfd, struct packet &pkt);
 
+/*
+wait until the peer acknowledged every packet written to a windowed socket, return at once on any other socket
+return 0 if success
+return -2 if failed to read ACK packet
+return -4 if the socket's queue of buffered requests is full
+*/
+int flush_socket(int socketfd);
+
 /*
 read the message from the socket, and set field for the pkt
+on a non-blocking socket it returns -9 once the socket has nothing left to read
 return 0 if read message is empty
 return -1 if recieved packet format is wrong
 return -2 if error happened in the read() funciton
 return -3 if failed to send ACK packet
-return -4 if recieved a ACK packet
 return -5 if recieved packet length is incorrect
 return -9 if time out
 return positive number if success, return is the total bytes of the message
 */
 int read_socket(int socketfd, struct packet &pkt);
 
+/*
+read_socket for an event loop on a non-blocking socket: never waits for another thread reading the socket
+return -9 if the socket has nothing left to read or another thread is reading it,
+that thread passes the socket to the pending handler once it lets go of it
+otherwise return as read_socket
+*/
+int read_socket_nowait(int socketfd, struct packet &pkt);
+
+/*
+the capability offer a client puts in rcvd_cnts of its LOGIN request
+*/
+string wire_offer();
+
+/*
+pick the capabilities to use from the rcvd_cnts of a LOGIN request
+return the ACCEPT string to put in rcvd_cnts of the LOGIN response
+return empty string if nothing was offered (old client), the connection stays in text mode
+*/
+string wire_negotiate(string offer);
+
+/*
+switch the socket to the capabilities listed in an ACCEPT string,
+frames written afterwards use the accepted format and window; reading always accepts both formats
+return 0 if success
+return -1 if the string is not an ACCEPT string
+*/
+int wire_apply(int socketfd, string accept);
+
+/*
+the rcvd_cnts of a SHOW request for up to limit posts older than post before (0 for the newest posts),
+version is the one of the same page read before if any, to be answered UNCHANGED if it still is
+*/
+string wall_page_request(unsigned int before, unsigned int limit, string version = "");
+
+/*
+read the page asked for in the rcvd_cnts of a SHOW request, version is empty if the request isn't conditional
+return 0 if a page was asked for
+return -1 if not, the whole wall is to be sent
+*/
+int wall_page_parse(string request, unsigned int *before, unsigned int *limit, string *version);
+
+/*
+the line starting the rcvd_cnts of a SHOW response to a page request,
+next is the before of the page that follows, 0 if it was the last page
+*/
+string wall_page_header(unsigned int next, string version);
+
+/*
+take the page line off the rcvd_cnts of a SHOW response and set next and version from it
+return 0 if success
+return -1 if the response has no page line (not a page, UNCHANGED or an error message)
+*/
+int wall_page_split(string &response, unsigned int *next, string *version);
+
+/*
+the rcvd_cnts of a LIST request, version is the one of the list read before (empty if none)
+*/
+string list_request(string version);
+
+/*
+read the version in the rcvd_cnts of a LIST request
+return 0 if the client takes versions, version is empty if it has none yet
+return -1 if not (old client), the list is sent without one
+*/
+int list_parse(string request, string *version);
+
+/*
+the line starting the rcvd_cnts of a LIST response to a client taking versions
+*/
+string list_header(string version);
+
+/*
+take the version line off the rcvd_cnts of a LIST response and set version from it
+return 0 if success
+return -1 if the response has no version line (UNCHANGED or an error message)
+*/
+int list_split(string &response, string *version);
+
+/*
+the rcvd_cnts of a SHOW or LIST response to a request whose version is still current
+*/
+string unchanged_response(string version);
+
+/*
+return true if the rcvd_cnts of a response is an unchanged_response
+*/
+bool is_unchanged(string response);
+
+/*
+return the format used when writing to the socket
+*/
+enum wireModes get_wire_mode(int socketfd);
+
+/*
+handler is called with the socket when a thread waiting for an ACK has left frames for read_socket in the
+buffers of the socket, or when read_socket_nowait gave up the socket to the thread reading it;
+an event loop uses it to read a socket that will not become readable for them
+*/
+void set_pending_handler(void (*handler)(int socketfd));
+
+/*
+queue the pkt to be written to the socket by one of the DRAIN_THREADS drain threads and return at once;
+the queue is written in order, a window of packets at a time, each window flushed before the next
+tag is passed back to the delivered handler with the result of the packet
+return 0 if queued
+return -1 if no drain thread could be started, the packets still queued are failed
+return -4 if the queue is full and the policy disconnects the socket
+*/
+int enqueue_socket(int socketfd, struct packet &pkt, uint64_t tag);
+
+/*
+set what enqueue_socket does once maxQueued packets wait for a socket
+*/
+void set_queue_policy(enum queuePolicies policy, unsigned int maxQueued);
+
+/*
+handler is called from a drain thread once the fate of a queued packet is known, with its tag and
+result 0 if the peer acknowledged it, -4 if the queue policy dropped it, -2 if writing it failed
+(a failed write fails every packet queued after it too, so no later packet arrives without it)
+*/
+void set_delivered_handler(void (*handler)(int socketfd, uint64_t tag, int result));
+
+/*
+handler is called by write_socket with each packet whose ACK it waited for, response_ms after writing it
+*/
+void set_ack_handler(void (*handler)(struct packet &pkt, double response_ms));
+
 #endif /* NETWORKING_H_ */
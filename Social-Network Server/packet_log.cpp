@@ -0,0 +1,331 @@
+#include "packet_log.h"
+#include <vector>
+#include <string>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+extern const char * getCommand(int enumVal);
+
+enum packetLogKinds {
+	PACKET_LOG_READ,
+	PACKET_LOG_WRITE,
+	PACKET_LOG_WRITE_ACKED
+};
+
+/*
+ * packetLogRecord - a logged packet, formatted by the log writer
+ * mode: string literal, NULL unless a write whose ACK is not waited for
+ * time: when the packet was read or written, the ACK received for PACKET_LOG_WRITE_ACKED
+ */
+struct packetLogRecord {
+	enum packetLogKinds kind;
+	uint32_t connection;
+	int bytes;
+	unsigned int content_len;
+	int cmd_code;
+	unsigned int req_num;
+	unsigned int sessionId;
+	const char *mode;
+	struct timespec time;
+	double response_ms;
+};
+
+/*
+ * packetLogRing - records of one thread, the thread adds at head and the log writer removes at tail
+ * seen: packets the thread logged, for sampling (thread only)
+ * dropped: records that did not fit since the log writer last looked
+ * retired: the thread has exited, the ring is freed once empty
+ */
+struct packetLogRing {
+	struct packetLogRecord records[PACKET_LOG_RING];
+	std::atomic<unsigned int> head;
+	std::atomic<unsigned int> tail;
+	unsigned int seen;
+	std::atomic<unsigned long> dropped;
+	std::atomic<bool> retired;
+};
+
+static std::atomic<int> logLevel(PACKET_LOG_ALL);
+static std::atomic<unsigned int> logSample(1);
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;	//list of rings, taken when a thread logs its first packet
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;	//the log writer and an exiting process emptying the rings
+static std::vector<struct packetLogRing *> *rings;	//never freed, the log writer outlives static destructors
+static FILE *logFile = NULL;
+static bool tracing = false;	//records go to the trace below (under drainLock)
+static std::string tracePath;
+static int traceFd = -1;
+static char *traceMap = NULL;
+static struct packetTraceHeader *traceHeader = NULL;
+
+//the thread has exited, leave its ring for the log writer to free
+static void retire_ring(void *ring) {
+	((struct packetLogRing *) ring)->retired.store(true, std::memory_order_release);
+}
+
+static void *log_writer(void *) {
+	struct timespec interval = {0, PACKET_LOG_INTERVAL_MS * 1000000L};
+
+	while(1) {
+		nanosleep(&interval, NULL);
+		packet_log_flush();
+	}
+	return NULL;
+}
+
+static void start_log_writer() {
+	pthread_t writer;
+	pthread_attr_t attr;
+
+	rings = new std::vector<struct packetLogRing *>;
+	pthread_key_create(&ringKey, retire_ring);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&writer, &attr, log_writer, NULL) != 0)
+		fprintf(stderr, "Failed to start the packet log writer\n");
+	atexit(packet_log_flush);
+}
+
+//ring of the calling thread, created the first time it logs
+static struct packetLogRing *get_ring() {
+	pthread_once(&logOnce, start_log_writer);
+	struct packetLogRing *ring = (struct packetLogRing *) pthread_getspecific(ringKey);
+	if(ring != NULL)
+		return ring;
+	ring = new struct packetLogRing;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->seen = 0;
+	ring->dropped = 0;
+	ring->retired = false;
+	pthread_setspecific(ringKey, ring);
+	pthread_mutex_lock(&ringsLock);
+	rings->push_back(ring);
+	pthread_mutex_unlock(&ringsLock);
+	return ring;
+}
+
+static void log_record(enum packetLogLevels level, enum packetLogKinds kind, uint32_t connection, int bytes, struct packet &pkt,
+		const char *mode, double response_ms) {
+	if(logLevel.load(std::memory_order_relaxed) < level)
+		return;
+	struct packetLogRing *ring = get_ring();
+	if(++ring->seen % logSample.load(std::memory_order_relaxed) != 0)
+		return;
+
+	unsigned int head = ring->head.load(std::memory_order_relaxed);
+	if(head - ring->tail.load(std::memory_order_acquire) >= PACKET_LOG_RING) {	//the log writer is behind, never wait for it
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	struct packetLogRecord &record = ring->records[head % PACKET_LOG_RING];
+	record.kind = kind;
+	record.connection = connection;
+	record.bytes = bytes;
+	record.content_len = pkt.content_len;
+	record.cmd_code = pkt.cmd_code;
+	record.req_num = pkt.req_num;
+	record.sessionId = pkt.sessionId;
+	record.mode = mode;
+	record.response_ms = response_ms;
+	clock_gettime(CLOCK_REALTIME, &record.time);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void packet_log_config(enum packetLogLevels level, unsigned int sample) {
+	logLevel.store(level);
+	logSample.store(sample > 0 ? sample : 1);
+}
+
+void packet_log_read(uint32_t connection, int bytes, struct packet &pkt) {
+	log_record(PACKET_LOG_ALL, PACKET_LOG_READ, connection, bytes, pkt, NULL, 0);
+}
+
+void packet_log_write(uint32_t connection, int bytes, struct packet &pkt, const char *mode) {
+	log_record(PACKET_LOG_ALL, PACKET_LOG_WRITE, connection, bytes, pkt, mode, 0);
+}
+
+void packet_log_acked(uint32_t connection, int bytes, struct packet &pkt, double response_ms) {
+	log_record(PACKET_LOG_ACKED, PACKET_LOG_WRITE_ACKED, connection, bytes, pkt, NULL, response_ms);
+}
+
+//create the trace file at tracePath and map it, under drainLock
+static int open_trace() {
+	traceFd = open(tracePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(traceFd < 0) {
+		perror("Failed to create the packet trace");
+		return -1;
+	}
+	if(ftruncate(traceFd, PACKET_TRACE_BYTES) < 0) {
+		perror("Failed to size the packet trace");
+		close(traceFd);
+		traceFd = -1;
+		return -1;
+	}
+	traceMap = (char *) mmap(NULL, PACKET_TRACE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, traceFd, 0);
+	if(traceMap == MAP_FAILED) {
+		perror("Failed to map the packet trace");
+		traceMap = NULL;
+		close(traceFd);
+		traceFd = -1;
+		return -1;
+	}
+	traceHeader = (struct packetTraceHeader *) traceMap;
+	memcpy(traceHeader->magic, PACKET_TRACE_MAGIC, sizeof(traceHeader->magic));
+	traceHeader->version = PACKET_TRACE_VERSION;
+	traceHeader->record_size = sizeof(struct packetTraceRecord);
+	traceHeader->records = 0;
+	traceHeader->dropped = 0;
+	return 0;
+}
+
+//the trace file is full: cut it to the records written, keep it as <file>.1 and start a new one
+static int rotate_trace() {
+	off_t used = sizeof(struct packetTraceHeader) + traceHeader->records * sizeof(struct packetTraceRecord);
+
+	munmap(traceMap, PACKET_TRACE_BYTES);
+	traceMap = NULL;
+	traceHeader = NULL;
+	if(ftruncate(traceFd, used) < 0)
+		perror("Failed to trim the packet trace");
+	close(traceFd);
+	traceFd = -1;
+	if(rename(tracePath.c_str(), (tracePath + ".1").c_str()) < 0)
+		perror("Failed to rotate the packet trace");
+	return open_trace();
+}
+
+int packet_log_trace(const char *path) {
+	int ret;
+
+	pthread_once(&logOnce, start_log_writer);
+	pthread_mutex_lock(&drainLock);
+	tracePath = path;
+	ret = open_trace();
+	tracing = ret == 0;
+	pthread_mutex_unlock(&drainLock);
+	return ret;
+}
+
+//time as asctime formats it, newline included
+static const char *format_time(struct timespec &time, char *buf) {
+	struct tm local;
+	localtime_r(&time.tv_sec, &local);
+	return asctime_r(&local, buf);
+}
+
+static void write_record(struct packetLogRecord &record) {
+	char at[32], sentAt[32];
+	struct timespec sent;
+	long long sentNs;
+
+	if(logFile == NULL)
+		return;
+	switch(record.kind) {
+	case PACKET_LOG_READ:
+		fprintf(logFile, "Read %d byte at %s\t[len: %u | cmd: %s | num: %u | sid: %u]\n\n", record.bytes,
+				format_time(record.time, at), record.content_len, getCommand(record.cmd_code), record.req_num, record.sessionId);
+		break;
+	case PACKET_LOG_WRITE:
+		fprintf(logFile, "Write %d byte at %s\t[len: %u | cmd: %s | num: %u | sid: %u] %s\n\n", record.bytes,
+				format_time(record.time, at), record.content_len, getCommand(record.cmd_code), record.req_num, record.sessionId,
+				record.mode);
+		break;
+	case PACKET_LOG_WRITE_ACKED:
+		sentNs = record.time.tv_sec * 1000000000LL + record.time.tv_nsec - (long long) (record.response_ms * 1000000);
+		sent.tv_sec = sentNs / 1000000000LL;
+		sent.tv_nsec = sentNs % 1000000000LL;
+		fprintf(logFile, "Write %d byte at %s\t[len: %u | cmd: %s | num: %u | sid: %u]\n", record.bytes,
+				format_time(sent, sentAt), record.content_len, getCommand(record.cmd_code), record.req_num, record.sessionId);
+		fprintf(logFile, "Received ACK packet at %sResponse time: %f ms\n\n", format_time(record.time, at), record.response_ms);
+		break;
+	}
+}
+
+static void trace_record(struct packetLogRecord &record) {
+	const uint64_t capacity = (PACKET_TRACE_BYTES - sizeof(struct packetTraceHeader)) / sizeof(struct packetTraceRecord);
+
+	if(traceHeader->records == capacity && rotate_trace() < 0) {
+		fprintf(stderr, "Packet trace stopped, logging to %s\n", PACKET_LOG_FILE);
+		tracing = false;
+		if(logFile == NULL)
+			logFile = fopen(PACKET_LOG_FILE, "a");
+		write_record(record);	//the record that found the trace full goes to the text log with the rest
+		return;
+	}
+	struct packetTraceRecord *trace = (struct packetTraceRecord *) (traceMap + sizeof(struct packetTraceHeader))
+			+ traceHeader->records;
+	trace->time_ns = record.time.tv_sec * 1000000000ULL + record.time.tv_nsec;
+	trace->connection = record.connection;
+	trace->direction = record.kind == PACKET_LOG_READ ? PACKET_TRACE_READ : PACKET_TRACE_WRITE;
+	trace->flags = 0;
+	trace->latency_us = 0;
+	if(record.kind == PACKET_LOG_WRITE_ACKED) {	//time of the write, as in the text log
+		trace->flags = PACKET_TRACE_ACKED;
+		trace->latency_us = record.response_ms * 1000;
+		trace->time_ns -= (uint64_t) trace->latency_us * 1000;
+	} else if(record.kind == PACKET_LOG_WRITE)
+		trace->flags = strcmp(record.mode, "implicit") == 0 ? PACKET_TRACE_IMPLICIT : PACKET_TRACE_WINDOWED;
+	trace->cmd_code = record.cmd_code;
+	trace->req_num = record.req_num;
+	trace->sessionId = record.sessionId;
+	trace->bytes = record.bytes;
+	__atomic_store_n(&traceHeader->records, traceHeader->records + 1, __ATOMIC_RELEASE);	//a reader of the live file sees whole records
+}
+
+void packet_log_flush() {
+	std::vector<struct packetLogRing *> current;
+	unsigned long dropped = 0;
+
+	pthread_once(&logOnce, start_log_writer);
+	pthread_mutex_lock(&drainLock);
+	if(!tracing && logFile == NULL) {
+		logFile = fopen(PACKET_LOG_FILE, "a");
+		if(logFile == NULL) {
+			pthread_mutex_unlock(&drainLock);
+			return;
+		}
+	}
+	pthread_mutex_lock(&ringsLock);
+	current = *rings;
+	pthread_mutex_unlock(&ringsLock);
+
+	for(struct packetLogRing *ring : current) {
+		unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+		unsigned int head = ring->head.load(std::memory_order_acquire);
+		for(; tail != head; tail++) {
+			if(tracing)	//falls back to write_record if the trace could not be rotated
+				trace_record(ring->records[tail % PACKET_LOG_RING]);
+			else
+				write_record(ring->records[tail % PACKET_LOG_RING]);
+		}
+		ring->tail.store(tail, std::memory_order_release);
+		dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+	}
+	if(tracing)
+		traceHeader->dropped += dropped;
+	else if(logFile != NULL) {
+		if(dropped > 0)
+			fprintf(logFile, "%lu packet log records dropped (log writer behind)\n\n", dropped);
+		fflush(logFile);
+	}
+
+	//free the rings of exited threads once they are empty
+	pthread_mutex_lock(&ringsLock);
+	for(size_t i = 0; i < rings->size();) {
+		struct packetLogRing *ring = (*rings)[i];
+		if(ring->retired.load(std::memory_order_acquire)
+				&& ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire)) {
+			(*rings)[i] = rings->back();
+			rings->pop_back();
+			delete ring;
+			continue;
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&ringsLock);
+	pthread_mutex_unlock(&drainLock);
+}
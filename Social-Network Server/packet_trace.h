@@ -0,0 +1,54 @@
+#ifndef PACKET_TRACE_H_
+#define PACKET_TRACE_H_
+
+#include <stdint.h>
+
+#define PACKET_TRACE_MAGIC "WTTRACE"	//with its NUL, the 8 bytes a trace file starts with
+#define PACKET_TRACE_VERSION 1
+#define PACKET_TRACE_BYTES (64 * 1024 * 1024)	//size of a trace file, it is rotated to <file>.1 once full
+
+/*
+binary packet trace, written by the packet log writer in place of log.txt (all integers in host byte order):
+	packetTraceHeader	at offset 0
+	packetTraceRecord	records of them following the header, in the order the log writer took them
+the file has the size it was created with, records tells how much of it is written
+*/
+struct packetTraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;	//sizeof(struct packetTraceRecord)
+	uint64_t records;	//updated after the records it counts are written
+	uint64_t dropped;	//records the log writer could not take, see PACKET_LOG_RING
+};
+
+enum packetTraceDirections {
+	PACKET_TRACE_READ,
+	PACKET_TRACE_WRITE
+};
+
+#define PACKET_TRACE_ACKED 0x01	//the writer waited for the ACK, latency_us is its response time
+#define PACKET_TRACE_WINDOWED 0x02	//written without waiting for the ACK, within the window
+#define PACKET_TRACE_IMPLICIT 0x04	//written without an ACK
+
+/*
+ * packetTraceRecord - a packet read or written
+ * time_ns: CLOCK_REALTIME when it was read or written
+ * connection: socket fd in the low 16 bits, how many times the fd was reused above them
+ * latency_us: from the write to its ACK for PACKET_TRACE_ACKED, 0 otherwise
+ */
+struct packetTraceRecord {
+	uint64_t time_ns;
+	uint32_t connection;
+	uint8_t direction;
+	uint8_t flags;
+	uint16_t cmd_code;
+	uint32_t req_num;
+	uint32_t sessionId;
+	uint32_t bytes;
+	uint32_t latency_us;
+};
+
+static_assert(sizeof(struct packetTraceHeader) == 32, "trace header layout changed");
+static_assert(sizeof(struct packetTraceRecord) == 32, "trace record layout changed");
+
+#endif /* PACKET_TRACE_H_ */
@@ -2,9 +2,11 @@
 #include "func_lib.h"
 #include "mysql_lib.h"
 #include "structures.h"
+#include "stats.h"
+#include "spans.h"
 
-extern DatabaseCommandInterface database;
-extern unsigned int sessionID;
+extern DatabaseConnectionPool databasePool;
+extern unsigned int clientSessionID[];
 using namespace std;
 
 /*
@@ -15,6 +17,7 @@ void handleClient(int sock_fd)
 {
 	int sock_read, ret;
 
+	clientSessionID[sock_fd] = 0;
 
 	/* Accept the request persistently*/
 	while(1)
@@ -32,36 +35,13 @@ void handleClient(int sock_fd)
 		}
 		if (!sock_read ) /*Client connection EOF */
 		{
-			req.sessionId = sessionID;
-			ret = database.logout(req);
+			ret = clientClosed(sock_fd);
 			if (ret < 0)
-			{
-				printf("Error (logout): User logging out from database failed\n");
 				return;
-			}
 			break;
 		}
 
-		/* Parse the packet for valid packet structure */
-		ret = parsePacket(&req);
-		if (ret < 0)
-		{
-			printf("Error (parsePacket): Packet parsing/checking failed\n");
-			break;
-		}
-
-		/* Validate session of the client */
-		ret = sessionValidity(&req);
-		if (ret < 0)
-		{
-			sendPacket(sock_fd, req);
-			if (ret == -2)
-				printf("Error (sessionValidity): DB could not process session validity\nClosing Client Connection\n");
-			break;
-		}
-
-		/* process the request */
-		ret = processRequest(sock_fd, req);
+		ret = runRequest(sock_fd, req);
 		if (ret < 0)
 			break;
 	}
@@ -70,6 +50,77 @@ void handleClient(int sock_fd)
 	return;
 }
 
+/*
+ * serveRequest() - check and process one request read from a client
+ * sock_fd: slave socket file descriptor
+ * req: request structure
+ * received: when it was read, for the request latency
+ * return 0(request served) -1(connection to be closed)
+ */
+int serveRequest(int sock_fd, struct packet &req, chrono::steady_clock::time_point received)
+{
+	chrono::steady_clock::time_point span;
+	int ret;
+
+	spanRequestBegin(req, received);
+	/* Parse the packet for valid packet structure */
+	span = spanStart();
+	ret = parsePacket(&req);
+	spanEnd("parse", span);
+	if (ret < 0)
+	{
+		printf("Error (parsePacket): Packet parsing/checking failed\n");
+		spanRequestEnd(req);
+		return -1;
+	}
+
+	/* Validate session of the client */
+	span = spanStart();
+	ret = sessionValidity(&req);
+	spanEnd("session", span);
+	if (ret < 0)
+	{
+		sendPacket(sock_fd, req);
+		statsRejected();
+		spanRequestEnd(req);
+		if (ret == -2)
+			printf("Error (sessionValidity): DB could not process session validity\nClosing Client Connection\n");
+		return -1;
+	}
+
+	/* process the request */
+	ret = processRequest(sock_fd, req);
+	statsRequest(req.cmd_code, received);
+	spanRequestEnd(req);
+	return ret;
+}
+
+/*
+ * clientClosed() - log out the user of a connection the client closed
+ * sock_fd: slave socket file descriptor
+ * return 0(success) -1(logout failed)
+ */
+int clientClosed(int sock_fd)
+{
+	DatabaseCommandInterface *database;
+	struct packet req;
+	int ret;
+
+	if (clientSessionID[sock_fd] == 0) /* nobody logged in on it */
+		return 0;
+	req.sessionId = clientSessionID[sock_fd];
+	database = databasePool.checkout();
+	ret = database->logout(req);
+	databasePool.checkin(database, ret == -2);
+	if (ret < 0)
+	{
+		printf("Error (logout): User logging out from database failed\n");
+		return -1;
+	}
+	clientSessionID[sock_fd] = 0;
+	return 0;
+}
+
 /*
  * parsePacket() - parse the packet and validate all fields
  * req: request structure
@@ -107,9 +158,14 @@ int parsePacket(struct packet *req)
  */
 int sessionValidity(struct packet *req)
 {
+	DatabaseCommandInterface *database;
 	int ret = 0;
 	if (req->cmd_code != LOGIN)
-		ret = database.hasValidSession(*req);
+	{
+		database = databasePool.checkout();
+		ret = database->hasValidSession(*req);
+		databasePool.checkin(database, ret == -2);
+	}
 	return ret;
 }
 
@@ -0,0 +1,218 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <vector>
+#include "func_lib.h"
+
+extern unsigned int clientSessionID[];
+using namespace std;
+
+#define MAX_EVENTS 64
+
+/*
+ * eventLoop - an epoll instance and the thread running it
+ * epoll_fd: epoll instance watching the client sockets of the loop, edge triggered
+ * wake_fd: eventfd the loop watches too, written when a socket is added to pending
+ * pending: sockets with frames left in their buffers by another thread (under pending_lock)
+ */
+struct eventLoop {
+	int epoll_fd;
+	int wake_fd;
+	pthread_mutex_t pending_lock;
+	vector<int> pending;
+};
+
+static struct eventLoop *loops;
+static int loop_count;
+static bool client_open[MAX_CONNECTIONS];	/* socket is served by a loop, only its loop clears it */
+static bool client_pending[MAX_CONNECTIONS];	/* socket is in pending of its loop (under pending_lock) */
+
+/*
+ * serviceClient() - queue every request a client socket has for the workers, until it would block
+ * the loop never serves a request itself nor waits for a worker reading the socket, either would stall all its sockets
+ * sock_fd: slave socket file descriptor
+ */
+static void serviceClient(int sock_fd)
+{
+	int sock_read;
+	bool client_eof = false;
+
+	while(1)
+	{
+		struct packet req;
+
+		sock_read = read_socket_nowait(sock_fd, req);
+		if (sock_read == -9) /* nothing left or another thread reads it, wait for the next event or wake-up */
+			return;
+		if (sock_read < 0)
+		{
+			printf("Error(read_socket_nowait)\n");
+			break;
+		}
+		if (!sock_read) /*Client connection EOF */
+		{
+			client_eof = true;
+			break;
+		}
+		queueRequest(sock_fd, req);
+	}
+	client_open[sock_fd] = false;
+	/* a worker may still be serving the socket, it closes it after the queued requests */
+	queueClose(sock_fd, client_eof);
+	return;
+}
+
+/*
+ * wakeLoop() - have the loop owning a socket read it without an event from epoll
+ * sock_fd: slave socket file descriptor
+ */
+static void wakeLoop(int sock_fd)
+{
+	struct eventLoop *loop = &loops[sock_fd % loop_count];
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&loop->pending_lock);
+	if (client_pending[sock_fd])
+	{
+		pthread_mutex_unlock(&loop->pending_lock);
+		return;
+	}
+	client_pending[sock_fd] = true;
+	loop->pending.push_back(sock_fd);
+	pthread_mutex_unlock(&loop->pending_lock);
+	if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+		printf("Error (write): %s\n", strerror(errno));
+	return;
+}
+
+/*
+ * runEventLoop() - wait for events of the loop's sockets and serve them
+ * loop: the event loop
+ */
+static void runEventLoop(struct eventLoop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	vector<int> pending;
+	uint64_t count;
+	int ready, i;
+
+	while(1)
+	{
+		ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("Error (epoll_wait): %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < ready; i++)
+		{
+			if (events[i].data.fd == loop->wake_fd)
+			{
+				if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					printf("Error (read): %s\n", strerror(errno));
+				pthread_mutex_lock(&loop->pending_lock);
+				pending.swap(loop->pending);
+				for (int sock_fd : pending)
+					client_pending[sock_fd] = false;
+				pthread_mutex_unlock(&loop->pending_lock);
+				for (int sock_fd : pending)
+				{
+					if (client_open[sock_fd]) /* not closed since it was queued */
+						serviceClient(sock_fd);
+				}
+				pending.clear();
+				continue;
+			}
+			/* readable, hung up or in error: read_socket_nowait tells which */
+			if (client_open[events[i].data.fd]) /* not closed earlier in this batch */
+				serviceClient(events[i].data.fd);
+		}
+	}
+	pthread_exit(NULL);
+	return;
+}
+
+/*
+ * startEventLoops() - create the event loops and a thread running each, the workers must be running
+ * count: number of loops
+ * return 0(success) -1(error)
+ */
+int startEventLoops(int count)
+{
+	pthread_t loopThread;
+	pthread_attr_t attr;
+	struct epoll_event event;
+	int ret, i;
+
+	if (!workersRunning())
+	{
+		printf("Error (startEventLoops): Event loops need workers to serve the requests\n");
+		return -1;
+	}
+	loops = new struct eventLoop[count];
+	loop_count = count;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < count; i++)
+	{
+		loops[i].epoll_fd = epoll_create1(0);
+		loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (loops[i].epoll_fd < 0 || loops[i].wake_fd < 0)
+		{
+			printf("Error (epoll_create1/eventfd): %s\n", strerror(errno));
+			return -1;
+		}
+		pthread_mutex_init(&loops[i].pending_lock, NULL);
+		event.events = EPOLLIN;
+		event.data.fd = loops[i].wake_fd;
+		if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &event) < 0)
+		{
+			printf("Error (epoll_ctl): %s\n", strerror(errno));
+			return -1;
+		}
+		ret = pthread_create(&loopThread, &attr, (void * (*) (void *)) runEventLoop, (void *) &loops[i]);
+		if (ret != 0)
+		{
+			printf("Error (pthread_create): %s\n", strerror(ret));
+			return -1;
+		}
+	}
+	set_pending_handler(wakeLoop);
+	return 0;
+}
+
+/*
+ * addClient() - hand an accepted socket to the event loop that owns it
+ * sock_fd: slave socket file descriptor
+ * return 0(success) -1(error)
+ */
+int addClient(int sock_fd)
+{
+	struct eventLoop *loop = &loops[sock_fd % loop_count];
+	struct epoll_event event;
+	int flags;
+
+	if (sock_fd >= MAX_CONNECTIONS)
+	{
+		printf("Error (addClient): too many connections\n");
+		return -1;
+	}
+	clientSessionID[sock_fd] = 0;
+	client_open[sock_fd] = true;
+	flags = fcntl(sock_fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		printf("Error (fcntl): %s\n", strerror(errno));
+		return -1;
+	}
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	event.data.fd = sock_fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) < 0)
+	{
+		printf("Error (epoll_ctl): %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
@@ -1,39 +1,203 @@
 #include <pthread.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
 #include "func_lib.h"
 #include  "mysql_lib.h"
+#include "stats.h"
+#include "spans.h"
 
-extern pthread_cond_t notify_cond;
-extern pthread_mutex_t notify_mutex;
 extern MySQLDatabaseDriver databaseDriver;
+extern DatabaseConnectionPool databasePool;
 
 #define SERVER_URL "tcp://127.0.0.1:3306"
 #define SERVER_USERNAME "root"
 #define SERVER_PASSWORD "socialnetworkpswd"
 #define SERVER_DATABASE "SocialNetwork"
-int notify_variable;
 
-void processNotification()
+/*
+ * delivery - fate of a queued notification, reported by a drain thread of the networking layer
+ * reported: when the drain thread reported it, for the notification latency
+ */
+struct delivery {
+	unsigned int user_id;
+	unsigned int post_id;
+	int result;
+	chrono::steady_clock::time_point reported;
+};
+
+/*
+ * dispatcher - a notification thread and the users it delivers to (user id % dispatcher_count == index)
+ * index: shard of the users
+ * notify_mutex: guards delivered and the trace and orders notify_variable against the wait, held only
+ *               to hand them to the dispatcher
+ * notify_cond: signalled when there may be new notifications or deliveries were reported
+ * notify_variable: set by a login or post, the users may have new notifications; a wake-up finding it
+ *                  already set leaves the signal to the one that set it and takes no lock
+ * delivered: fates reported but not handled yet
+ * traced, trace: a sampled request set notify_variable, the next round is traced under it (see spanTrace)
+ */
+struct dispatcher {
+	unsigned int index;
+	pthread_mutex_t notify_mutex;
+	pthread_cond_t notify_cond;
+	atomic<int> notify_variable;
+	vector<struct delivery> delivered;
+	bool traced;
+	uint64_t trace;
+};
+
+static struct dispatcher *dispatchers;
+static unsigned int dispatcher_count;
+
+/*
+ * notificationDelivered() - record the fate of a queued notification and wake the dispatcher of its user
+ * tag: user id and post id of the notification
+ * result: 0(acknowledged) -4(dropped by the queue policy) other(write failed)
+ */
+static void notificationDelivered(int, uint64_t tag, int result)
+{
+	unsigned int user_id = (unsigned int) (tag >> 32);
+	struct dispatcher *dispatch = &dispatchers[user_id % dispatcher_count];
+
+	pthread_mutex_lock(&dispatch->notify_mutex);
+	dispatch->delivered.push_back({user_id, (unsigned int) tag, result, chrono::steady_clock::now()});
+	pthread_cond_signal(&dispatch->notify_cond);
+	pthread_mutex_unlock(&dispatch->notify_mutex);
+	return;
+}
+
+/*
+ * wakeNotifications() - have every dispatcher look for new notifications
+ */
+void wakeNotifications()
+{
+	spanScope span("notify.wake");
+	uint64_t trace;
+	bool traced = spanTrace(&trace);
+
+	for (unsigned int i = 0; i < dispatcher_count; i++)
+	{
+		/* a round is already due, a burst of posts costs the dispatcher one lock and one signal */
+		if (dispatchers[i].notify_variable.exchange(1) && !traced)
+			continue;
+		pthread_mutex_lock(&dispatchers[i].notify_mutex);
+		if (traced)
+		{
+			dispatchers[i].traced = true;
+			dispatchers[i].trace = trace;
+		}
+		pthread_cond_signal(&dispatchers[i].notify_cond);
+		pthread_mutex_unlock(&dispatchers[i].notify_mutex);
+	}
+	return;
+}
+
+/*
+ * processNotification() - deliver the notifications of the users of a dispatcher
+ * dispatch: the dispatcher
+ */
+static void processNotification(struct dispatcher *dispatch)
 {
-	int sock_fd, read, sock_write;
+	int sock_fd, read, queue, user_id, post_id;
 	int ret = 0;
+	struct timespec deadline;
+	chrono::steady_clock::time_point round;
+	bool wake, traced;
+	uint64_t trace;
+	/* last post queued for each user and not reported yet, so the next round doesn't queue it again */
+	map<unsigned int, unsigned int> queued;
+	/* when each notification not reported yet was queued, by tag so the ones of a user are in post order */
+	map<uint64_t, chrono::steady_clock::time_point> queued_at;
+	vector<struct delivery> reported;
 	DatabaseNotificationInterface notify(databaseDriver, SERVER_URL, SERVER_USERNAME,
 			SERVER_PASSWORD, SERVER_DATABASE);
 
-	pthread_mutex_lock(&notify_mutex);
+	/* online users come from the sessions of the request threads instead of InteractionLog */
+	notify.useSessionTable(databasePool.sessionTable());
+	notify.setShard(dispatch->index, dispatcher_count);
+
+	pthread_mutex_lock(&dispatch->notify_mutex);
 
 	while (1)
 	{
-		while (!notify_variable)
+		while (!dispatch->notify_variable && dispatch->delivered.empty())
 		{
-			pthread_cond_wait(&notify_cond, &notify_mutex);
+			if (!notify.readsUnwritten())
+			{
+				pthread_cond_wait(&dispatch->notify_cond, &dispatch->notify_mutex);
+				continue;
+			}
+			/* nothing new to send for a while, write the cursors still in memory */
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += notify.read_flush_interval;
+			if (pthread_cond_timedwait(&dispatch->notify_cond, &dispatch->notify_mutex, &deadline) == ETIMEDOUT)
+			{
+				pthread_mutex_unlock(&dispatch->notify_mutex);
+				if (notify.flushRead() < 0)
+					printf("Error (flushRead): writing read cursors failed (retrying)\n");
+				pthread_mutex_lock(&dispatch->notify_mutex);
+			}
 		}
-		notify_variable = 0;
+		/* take what was signalled and let go, drain threads and wake-ups never wait for the database */
+		reported.swap(dispatch->delivered);
+		wake = dispatch->notify_variable.exchange(0);
+		traced = dispatch->traced;
+		trace = dispatch->trace;
+		dispatch->traced = false;
+		pthread_mutex_unlock(&dispatch->notify_mutex);
+
+		for (struct delivery &sent : reported)
+		{
+			auto last = queued.find(sent.user_id);
+			/* a coalesced packet reports the last notification merged into it for the ones before it too */
+			auto first = queued_at.lower_bound((uint64_t) sent.user_id << 32);
+			auto end = queued_at.upper_bound(((uint64_t) sent.user_id << 32) | sent.post_id);
+			for (auto at = first; at != end; at++)
+				statsNotification(sent.reported - at->second, sent.result);
+			queued_at.erase(first, end);
+			if (sent.result == 0)
+			{
+				/* the drain threads write a socket's queue in order, everything before it arrived too */
+				read = notify.markRead(sent.user_id, sent.post_id);
+				if (read < 0)
+					printf("Error (markRead): writing read cursors failed (retrying)\n");
+				if (last != queued.end() && last->second <= sent.post_id)
+				{
+					queued.erase(last);
+					/* the page of the user arrived, the next round generates the next one */
+					if (notify.hasMorePosts(sent.user_id))
+						wake = true;
+				}
+			}
+			else if (sent.result != -4 && last != queued.end())
+			{
+				/* the rest of the socket's queue failed with it, sent again from the cursor next round */
+				queued.erase(last);
+			}
+		}
+		reported.clear();
+		if (!wake)
+		{
+			if (notify.flushRead(false) < 0)
+				printf("Error (flushRead): writing read cursors failed (retrying)\n");
+			pthread_mutex_lock(&dispatch->notify_mutex);
+			continue;
+		}
+		if (traced)
+			spanResume(trace);
+		round = spanStart();
 		ret = notify.getNotifications();
+		spanEnd("notify.getNotifications", round);
 		if (ret < 0)
 		{
 			printf("Error (getNotifications): get Notification failed\n");
-			break;
+			spanStop();
+			return;
 		}
+		/* a cursor only covers posts in order, so a user stops at the first post that couldn't be queued */
+		set<unsigned int> failed;
 		while ((ret > 0) && (notify.next() > 0))
 		{
 			struct packet notifyPkt;
@@ -43,20 +207,68 @@ void processNotification()
 				printf("Error (sendNotification): Notification sending failed\n");
 				break;
 			}
-			sock_write = write_socket(sock_fd, notifyPkt);
-			if (sock_write < 0)
+			user_id = notify.getUserID();
+			post_id = notify.getPostID();
+			if (user_id < 0 || post_id < 0)
 			{
-				printf("Error (write_socket): Notification sending failed (skipping to next notification)\n");
-				continue;
+				printf("Error (getUserID/getPostID): Notification sending failed\n");
+				break;
 			}
-			read = notify.markRead();
-			if (read < 0)
+			auto last = queued.find(user_id);
+			if (failed.count(user_id) || (last != queued.end() && (unsigned int) post_id <= last->second))
+				continue;
+			/* a drain thread writes it, a slow client only holds up its own queue */
+			queue = enqueue_socket(sock_fd, notifyPkt, ((uint64_t) user_id << 32) | (unsigned int) post_id);
+			if (queue < 0)
 			{
-				printf("Error (markRead): Notification sending failed\n");
-				break;
+				printf("Error (enqueue_socket): Notification sending failed (skipping to next user)\n");
+				failed.insert(user_id);
+				continue;
 			}
+			queued[user_id] = post_id;
+			queued_at[((uint64_t) user_id << 32) | (unsigned int) post_id] = chrono::steady_clock::now();
 		}
+		if (notify.flushRead(false) < 0)
+			printf("Error (flushRead): writing read cursors failed (retrying)\n");
+		spanEnd("notify.round", round);
+		spanStop();
+		pthread_mutex_lock(&dispatch->notify_mutex);
 	}
-	pthread_mutex_unlock(&notify_mutex);
 	return;
 }
+
+/*
+ * startNotifications() - create the dispatchers and a thread running each
+ * count: number of dispatchers, each with its own database connection
+ * return 0(success) -1(error)
+ */
+int startNotifications(int count)
+{
+	pthread_t notifyThread;
+	pthread_attr_t attr;
+	int ret, i;
+
+	dispatchers = new struct dispatcher[count];
+	dispatcher_count = count;
+	for (i = 0; i < count; i++)
+	{
+		dispatchers[i].index = i;
+		pthread_mutex_init(&dispatchers[i].notify_mutex, NULL);
+		pthread_cond_init(&dispatchers[i].notify_cond, NULL);
+		dispatchers[i].notify_variable = 0;
+		dispatchers[i].traced = false;
+	}
+	set_delivered_handler(notificationDelivered);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < count; i++)
+	{
+		ret = pthread_create(&notifyThread, &attr, (void * (*) (void *)) processNotification, (void *) &dispatchers[i]);
+		if (ret != 0)
+		{
+			printf("Error (pthread_create): %s\n", strerror(ret));
+			return -1;
+		}
+	}
+	return 0;
+}
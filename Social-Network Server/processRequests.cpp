@@ -1,35 +1,32 @@
 #include "func_lib.h"
 #include "structures.h"
 #include  "mysql_lib.h"
-extern DatabaseCommandInterface database;
-
-extern pthread_cond_t notify_cond;
-extern pthread_mutex_t notify_mutex;
-extern int notify_variable;
+#include "spans.h"
+extern DatabaseConnectionPool databasePool;
 
 using namespace std;
 #define DEBUG
 
-unsigned int sessionID;
+unsigned int clientSessionID[MAX_CONNECTIONS]; /* session of the user logged in on each socket */
 
 /*
  * processRequest() - validate the client session
  * req: request structure
- * return 0(request processed successfully) -1(request processing failed)
+ * return 0(request processed successfully) -1(connection to be closed)
  */
 int processRequest(int sock_fd, struct packet &req)
 {
 
 	if (req.cmd_code == LOGIN)
-		userLogin(sock_fd, req);
+		return userLogin(sock_fd, req);
 	else if(req.cmd_code == LOGOUT)
-		userLogout(sock_fd, req);
+		return userLogout(sock_fd, req);
 	else if(req.cmd_code == LIST)
-		listAllUsers(sock_fd, req);
+		return listAllUsers(sock_fd, req);
 	else if(req.cmd_code == POST)
-		postMessage(sock_fd, req);
+		return postMessage(sock_fd, req);
 	else if(req.cmd_code == SHOW)
-		showWallMessage(sock_fd, req);
+		return showWallMessage(sock_fd, req);
 	else
 		printf("Invalid Option\n");
 	return 0;
@@ -38,127 +35,177 @@ int processRequest(int sock_fd, struct packet &req)
 /*
  * userLogin() - login request for user
  * req: request structure
+ * return 0(request processed) -1(connection to be closed)
  */
-void userLogin(int sock_fd, struct packet &req)
+int userLogin(int sock_fd, struct packet &req)
 {
+	DatabaseCommandInterface *database;
 	int ret = 0, snd;
-
-	ret = database.login(req, sock_fd);
+	string accept;
+
+	/* pick the wire capabilities offered in rcvd_cnts, old clients offer nothing */
+	accept = wire_negotiate(req.contents.rcvd_cnts);
+	database = databasePool.checkout();
+	ret = database->login(req, sock_fd);
+	databasePool.checkin(database, ret == -2);
+	if (ret == 0)
+		req.contents.rcvd_cnts = accept;
 	snd = sendPacket(sock_fd, req);
 	if (snd < 0)
 	{
 		printf("Error (sendPacket): sending response failed\n");
-		return;
+		return 0;
 	}
 	if (ret == -2)
 	{
 		printf("Error (login): DB login error\nClosing Client Connection\n");
-		destroy_socket(sock_fd);
-		pthread_exit(NULL);
-		return;
+		return -1;
 	}
-	sessionID = req.sessionId;
-	pthread_mutex_lock(&notify_mutex);
-	notify_variable = 1;
-	pthread_cond_signal(&notify_cond);
-	pthread_mutex_unlock(&notify_mutex);
-	return;
+	/* the response went out in the old format, switch only after it was acknowledged */
+	if (ret == 0 && accept.length())
+		wire_apply(sock_fd, accept);
+	clientSessionID[sock_fd] = req.sessionId;
+	wakeNotifications();
+	return 0;
 }
 
 /*
  * listAllUsers() - List all users in the DB
- * req: request structure
+ * req: request structure, rcvd_cnts carries the version the client has (list_request) or is empty
+ * a client taking versions gets the list after list_header, or unchanged_response if its version is current
+ * return 0(request processed) -1(connection to be closed)
  */
-void listAllUsers(int sock_fd, struct packet &req)
+int listAllUsers(int sock_fd, struct packet &req)
 {
+	DatabaseCommandInterface *database;
+	string known, version;
+	bool versioned;
 	int ret = 0, snd;
 
-	ret = database.listUsers(req);
+	versioned = (list_parse(req.contents.rcvd_cnts, &known) == 0);
+	database = databasePool.checkout();
+	ret = database->listUsers(req, &version);
+	databasePool.checkin(database, ret == -2);
+	if (ret == 0 && versioned)
+	{
+		if (known == version)
+			req.contents.rcvd_cnts = unchanged_response(version);
+		else
+			req.contents.rcvd_cnts = list_header(version) + req.contents.rcvd_cnts;
+	}
 	snd = sendPacket(sock_fd, req);
 	if (snd < 0)
 	{
 		printf("Error (sendPacket): sending response failed\n");
-		return;
+		return 0;
 	}
 	if (ret == -2)
 	{
 		printf("Error (listUsers): DB listUsers error\nClosing Client Connection");
 		userLogout(sock_fd, req);
-		destroy_socket(sock_fd);
-		pthread_exit(NULL);
-		return;
+		return -1;
 	}
-	return;
+	return 0;
 }
 
 /*
  * postMessage() - Post a message to a user's wall
  * req: request structure
+ * return 0(request processed) -1(connection to be closed)
  */
-void postMessage(int sock_fd, struct packet &req)
+int postMessage(int sock_fd, struct packet &req)
 {
+	DatabaseCommandInterface *database;
 	int ret = 0, snd;
 
-	ret = database.postOnWall(req);
+	database = databasePool.checkout();
+	ret = database->postOnWall(req);
+	databasePool.checkin(database, ret == -2);
 	if (ret < 0)
 	{
 		printf("Error (postOnWall): post to database wall failed\n");
 		snd = sendPacket(sock_fd, req);
 		if (snd < 0)
 			printf("Error (sendPacket): sending response failed\n");
-		return;
+		return 0;
 	}
-	pthread_mutex_lock(&notify_mutex);
-	notify_variable = 1;
-	pthread_cond_signal(&notify_cond);
-	pthread_mutex_unlock(&notify_mutex);
-	return;
+	wakeNotifications();
+	return 0;
 }
 
 /*
- * showWallMessage() - show a user's wall
- * req: request structure
+ * showWallMessage() - show a user's wall, newest posts first
+ * req: request structure, rcvd_cnts asks for a page (wall_page_request) or is empty for the whole wall
+ * a page is answered with one response starting with wall_page_header, or unchanged_response if the
+ * request carries the version of the page, the whole wall is streamed as one response per page so it
+ * is never held in memory at once
+ * return 0(request processed) -1(connection to be closed)
  */
-void showWallMessage(int sock_fd, struct packet &req)
+int showWallMessage(int sock_fd, struct packet &req)
 {
+	DatabaseCommandInterface *database;
+	struct packet resp;
+	unsigned int before, limit, next, latest;
+	string known, version;
+	bool paged;
 	int ret, snd;
 
 	DEBUG("show %s's wall\n", req.contents.wallOwner.c_str());
-	ret = database.showWall(req);
-	snd = sendPacket(sock_fd, req);
-	if (snd < 0)
+	paged = (wall_page_parse(req.contents.rcvd_cnts, &before, &limit, &known) == 0);
+	if (!paged)
 	{
-		printf("Error (sendPacket): sending response failed\n");
-		return;
+		before = 0;
+		limit = WALL_PAGE_POSTS;
 	}
+	do
+	{
+		resp = req;
+		/* the connection goes back to the pool while the page is written */
+		database = databasePool.checkout();
+		ret = database->showWall(resp, before, limit, &next, &latest, before == 0 || paged);
+		databasePool.checkin(database, ret == -2);
+		version = to_string(latest);
+		if (ret == 0 && paged && known == version)
+			resp.contents.rcvd_cnts = unchanged_response(version);
+		else if (ret == 0 && paged)
+			resp.contents.rcvd_cnts = wall_page_header(next, version) + resp.contents.rcvd_cnts;
+		snd = sendPacket(sock_fd, resp);
+		if (snd < 0)
+		{
+			printf("Error (sendPacket): sending response failed\n");
+			return 0;
+		}
+		before = next;
+	} while (!paged && ret == 0 && next != 0);
 	if (ret == -2)
 	{
 		printf("Error (showWall): DB show Wall error\nClosing Client Connection\n");
 		userLogout(sock_fd, req);
-		destroy_socket(sock_fd);
-		pthread_exit(NULL);
-		return;
+		return -1;
 	}
-	return;
+	return 0;
 }
 
 /*
  * userLogout() - logout request for user
  * req: request structure
+ * return 0(logout failed, connection kept) -1(connection to be closed)
  */
-void userLogout(int sock_fd, struct packet &req)
+int userLogout(int sock_fd, struct packet &req)
 {
+	DatabaseCommandInterface *database;
 	int ret;
 
-	ret = database.logout(req);
+	database = databasePool.checkout();
+	ret = database->logout(req);
+	databasePool.checkin(database, ret == -2);
 	if (ret < 0)
 	{
 		printf("Error (logout): User logging out from database failed\n");
-		return;
+		return 0;
 	}
-	destroy_socket(sock_fd);
-	pthread_exit(NULL);
-	return;
+	clientSessionID[sock_fd] = 0;
+	return -1;
 }
 
 /*
@@ -168,6 +215,7 @@ void userLogout(int sock_fd, struct packet &req)
  */
 int sendPacket(int sock_fd, struct packet &resp)
 {
+	spanScope span("send");
 	int send_bytes;
 
 	send_bytes = write_socket(sock_fd, resp);
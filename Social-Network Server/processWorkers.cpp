@@ -0,0 +1,455 @@
+#include <deque>
+#include <chrono>
+#include <climits>
+#include <sched.h>
+#include "func_lib.h"
+
+using namespace std;
+
+#define CLIENT_LOCKS 64		/* stripes of locks guarding the per client job queues */
+#define JOB_BATCH 8		/* jobs of one client run before the worker moves on */
+#define STATS_INTERVAL_SEC 60
+
+enum jobTypes {
+	REQUEST_JOB,
+	CLOSE_JOB
+};
+
+/*
+ * jobWaiter - a thread waiting for the result of its job
+ */
+struct jobWaiter {
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	bool done;
+	int result;
+};
+
+/*
+ * job - work handed over by the network layer
+ * type: serve req, or close the socket once the jobs before it are done
+ * client_eof: for CLOSE_JOB, the client closed the connection and has to be logged out
+ * queued: when the job was queued, for the queue wait metrics
+ * waiter: thread waiting for the result, NULL if nobody waits
+ */
+struct job {
+	int sock_fd;
+	enum jobTypes type;
+	struct packet req;
+	bool client_eof;
+	chrono::steady_clock::time_point queued;
+	struct jobWaiter *waiter;
+};
+
+/*
+ * clientJobs - jobs of one socket, run in order by one worker at a time
+ * scheduled: the socket is in the queue of a worker or being run
+ * closing: a request closed the connection, requests after it are dropped
+ */
+struct clientJobs {
+	deque<struct job *> jobs;
+	bool scheduled;
+	bool closing;
+};
+
+/*
+ * workerQueue - sockets scheduled on a worker; the worker takes from the front,
+ * idle workers steal from the back
+ */
+struct workerQueue {
+	pthread_mutex_t lock;
+	deque<int> clients;
+};
+
+static struct workerQueue *workers;
+static int worker_count;
+static int max_queued_jobs;
+static struct clientJobs *clients[MAX_CONNECTIONS];
+static pthread_mutex_t client_locks[CLIENT_LOCKS];
+
+/* idle_lock guards the counters and metrics below */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;	/* a socket was scheduled */
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;	/* a job left the queues */
+static int scheduled_clients;
+static int queued_jobs;
+
+static unsigned long stat_jobs;
+static unsigned long stat_wait_total_us;
+static unsigned long stat_wait_max_us;
+static unsigned long stat_full_waits;
+static int stat_max_queued;
+static chrono::steady_clock::time_point stat_reported;
+
+/*
+ * scheduleClient() - put a socket with jobs in the queue of a worker
+ * sock_fd: slave socket file descriptor
+ * worker: index of the worker
+ */
+static void scheduleClient(int sock_fd, int worker)
+{
+	pthread_mutex_lock(&workers[worker].lock);
+	workers[worker].clients.push_back(sock_fd);
+	pthread_mutex_unlock(&workers[worker].lock);
+
+	pthread_mutex_lock(&idle_lock);
+	scheduled_clients++;
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+	return;
+}
+
+/*
+ * takeClient() - take a scheduled socket, from the own queue or stolen from another worker
+ * worker: index of the worker
+ * return socket file descriptor
+ */
+static int takeClient(int worker)
+{
+	int sock_fd, i;
+
+	pthread_mutex_lock(&idle_lock);
+	while (scheduled_clients == 0)
+		pthread_cond_wait(&idle_cond, &idle_lock);
+	scheduled_clients--;	/* one of the queues holds a socket for us */
+	pthread_mutex_unlock(&idle_lock);
+
+	while (1)
+	{
+		for (i = 0; i < worker_count; i++)
+		{
+			struct workerQueue *queue = &workers[(worker + i) % worker_count];
+
+			pthread_mutex_lock(&queue->lock);
+			if (!queue->clients.empty())
+			{
+				if (i == 0)
+				{
+					sock_fd = queue->clients.front();
+					queue->clients.pop_front();
+				}
+				else
+				{
+					sock_fd = queue->clients.back();
+					queue->clients.pop_back();
+				}
+				pthread_mutex_unlock(&queue->lock);
+				return sock_fd;
+			}
+			pthread_mutex_unlock(&queue->lock);
+		}
+		sched_yield();	/* claimed but not pushed yet */
+	}
+}
+
+/*
+ * jobDone() - account a job leaving the queues
+ * job: the job
+ */
+static void jobDone(struct job *job)
+{
+	auto now = chrono::steady_clock::now();
+	unsigned long wait_us = chrono::duration_cast<chrono::microseconds>(now - job->queued).count();
+
+	pthread_mutex_lock(&idle_lock);
+	queued_jobs--;
+	pthread_cond_signal(&room_cond);
+	stat_jobs++;
+	stat_wait_total_us += wait_us;
+	if (wait_us > stat_wait_max_us)
+		stat_wait_max_us = wait_us;
+	if (now - stat_reported >= chrono::seconds(STATS_INTERVAL_SEC))
+	{
+		printf("Workers: %lu jobs, queue wait avg %lu us max %lu us, %lu waits for room, deepest queue %d\n",
+				stat_jobs, stat_wait_total_us / stat_jobs, stat_wait_max_us, stat_full_waits, stat_max_queued);
+		stat_reported = now;
+	}
+	pthread_mutex_unlock(&idle_lock);
+	return;
+}
+
+/*
+ * finishJob() - hand the result to the waiting thread, or free the job
+ * job: the job
+ * result: result of the job
+ */
+static void finishJob(struct job *job, int result)
+{
+	if (job->waiter == NULL)
+	{
+		delete job;
+		return;
+	}
+	pthread_mutex_lock(&job->waiter->lock);
+	job->waiter->result = result;
+	job->waiter->done = true;
+	pthread_cond_signal(&job->waiter->done_cond);
+	pthread_mutex_unlock(&job->waiter->lock);
+	return;
+}
+
+/*
+ * dropJobs() - drop the queued requests of a socket, the caller holds its client lock
+ * client: jobs of the socket
+ */
+static void dropJobs(struct clientJobs *client)
+{
+	while (!client->jobs.empty() && client->jobs.front()->type == REQUEST_JOB)
+	{
+		struct job *job = client->jobs.front();
+
+		client->jobs.pop_front();
+		jobDone(job);
+		finishJob(job, -1);
+	}
+	return;
+}
+
+/*
+ * runJob() - serve a request or close a socket
+ * job: the job
+ */
+static void runJob(struct job *job)
+{
+	int sock_fd = job->sock_fd;
+	pthread_mutex_t *lock = &client_locks[sock_fd % CLIENT_LOCKS];
+	struct clientJobs *client = clients[sock_fd];
+	bool closing;
+	int ret;
+
+	if (job->type == CLOSE_JOB)
+	{
+		pthread_mutex_lock(lock);
+		closing = client->closing;
+		client->closing = false;	/* the descriptor may be reused once closed */
+		pthread_mutex_unlock(lock);
+		if (job->client_eof && !closing)
+			clientClosed(sock_fd);
+		destroy_socket(sock_fd);
+		finishJob(job, 0);
+		return;
+	}
+
+	ret = serveRequest(sock_fd, job->req, job->queued);
+	if (ret < 0 && job->waiter == NULL)
+	{
+		/* the event loop owns the socket: have it read EOF and queue the close */
+		pthread_mutex_lock(lock);
+		client->closing = true;
+		dropJobs(client);
+		pthread_mutex_unlock(lock);
+		shutdown(sock_fd, SHUT_RDWR);
+	}
+	finishJob(job, ret);
+	return;
+}
+
+/*
+ * runClient() - run a batch of the jobs of a socket
+ * sock_fd: slave socket file descriptor
+ * worker: index of the worker
+ */
+static void runClient(int sock_fd, int worker)
+{
+	pthread_mutex_t *lock = &client_locks[sock_fd % CLIENT_LOCKS];
+	struct clientJobs *client = clients[sock_fd];
+	int i;
+
+	for (i = 0; i < JOB_BATCH; i++)
+	{
+		pthread_mutex_lock(lock);
+		if (client->jobs.empty())
+		{
+			client->scheduled = false;
+			pthread_mutex_unlock(lock);
+			return;
+		}
+		struct job *job = client->jobs.front();
+		client->jobs.pop_front();
+		pthread_mutex_unlock(lock);
+
+		jobDone(job);
+		runJob(job);
+	}
+	/* more jobs left, let the other sockets of this worker go first */
+	scheduleClient(sock_fd, worker);
+	return;
+}
+
+/*
+ * runWorker() - take scheduled sockets and run their jobs
+ * worker: index of the worker
+ */
+static void runWorker(long worker)
+{
+	while (1)
+		runClient(takeClient(worker), worker);
+	return;
+}
+
+/*
+ * queueJob() - queue a job behind the other jobs of its socket
+ * job: the job
+ * wait_room: wait while max_queued_jobs are queued
+ */
+static void queueJob(struct job *job, bool wait_room)
+{
+	int sock_fd = job->sock_fd;
+	pthread_mutex_t *lock = &client_locks[sock_fd % CLIENT_LOCKS];
+	struct clientJobs *client;
+	bool schedule = false;
+
+	pthread_mutex_lock(&idle_lock);
+	if (wait_room && queued_jobs >= max_queued_jobs)
+	{
+		stat_full_waits++;
+		while (queued_jobs >= max_queued_jobs)
+			pthread_cond_wait(&room_cond, &idle_lock);
+	}
+	queued_jobs++;
+	if (queued_jobs > stat_max_queued)
+		stat_max_queued = queued_jobs;
+	pthread_mutex_unlock(&idle_lock);
+
+	job->queued = chrono::steady_clock::now();
+	pthread_mutex_lock(lock);
+	if (clients[sock_fd] == NULL)
+	{
+		clients[sock_fd] = new struct clientJobs;
+		clients[sock_fd]->scheduled = false;
+		clients[sock_fd]->closing = false;
+	}
+	client = clients[sock_fd];
+	if (client->closing && job->type == REQUEST_JOB)
+	{
+		pthread_mutex_unlock(lock);
+		jobDone(job);
+		finishJob(job, -1);
+		return;
+	}
+	client->jobs.push_back(job);
+	if (!client->scheduled)
+	{
+		client->scheduled = true;
+		schedule = true;
+	}
+	pthread_mutex_unlock(lock);
+
+	if (schedule)
+		scheduleClient(sock_fd, sock_fd % worker_count);
+	return;
+}
+
+/*
+ * startWorkers() - create the worker threads
+ * count: number of workers
+ * max_queued: jobs queued at most, submitters wait for room beyond it
+ * return 0(success) -1(error)
+ */
+int startWorkers(int count, int max_queued)
+{
+	pthread_t workerThread;
+	pthread_attr_t attr;
+	int ret, i;
+
+	if (count <= 0 || max_queued <= 0 || max_queued > INT_MAX / 2)
+		return -1;
+	for (i = 0; i < CLIENT_LOCKS; i++)
+		pthread_mutex_init(&client_locks[i], NULL);
+	workers = new struct workerQueue[count];
+	for (i = 0; i < count; i++)
+		pthread_mutex_init(&workers[i].lock, NULL);
+	worker_count = count;
+	max_queued_jobs = max_queued;
+	stat_reported = chrono::steady_clock::now();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < count; i++)
+	{
+		ret = pthread_create(&workerThread, &attr, (void * (*) (void *)) runWorker, (void *)((long) i));
+		if (ret != 0)
+		{
+			printf("Error (pthread_create): %s\n", strerror(ret));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * workersRunning() - whether requests go to the workers
+ */
+bool workersRunning(void)
+{
+	return worker_count > 0;
+}
+
+/*
+ * queueRequest() - have a worker serve a request, after the earlier jobs of its socket
+ * if serving fails the worker shuts the socket down; its owner then reads EOF and queues the close
+ * sock_fd: slave socket file descriptor
+ * req: request structure
+ */
+void queueRequest(int sock_fd, struct packet &req)
+{
+	struct job *job = new struct job;
+
+	job->sock_fd = sock_fd;
+	job->type = REQUEST_JOB;
+	job->req = req;
+	job->client_eof = false;
+	job->waiter = NULL;
+	queueJob(job, true);
+	return;
+}
+
+/*
+ * queueClose() - have a worker close a socket once its queued requests are served
+ * sock_fd: slave socket file descriptor
+ * client_eof: the client closed the connection, log its user out
+ */
+void queueClose(int sock_fd, bool client_eof)
+{
+	struct job *job = new struct job;
+
+	job->sock_fd = sock_fd;
+	job->type = CLOSE_JOB;
+	job->client_eof = client_eof;
+	job->waiter = NULL;
+	queueJob(job, false);	/* never held back, it frees a socket */
+	return;
+}
+
+/*
+ * runRequest() - serve a request on a worker and wait for it, or right here without workers
+ * sock_fd: slave socket file descriptor
+ * req: request structure
+ * return 0(request served) -1(connection to be closed)
+ */
+int runRequest(int sock_fd, struct packet &req)
+{
+	struct jobWaiter waiter;
+	struct job job;
+
+	if (!workersRunning())
+		return serveRequest(sock_fd, req, chrono::steady_clock::now());
+
+	pthread_mutex_init(&waiter.lock, NULL);
+	pthread_cond_init(&waiter.done_cond, NULL);
+	waiter.done = false;
+	job.sock_fd = sock_fd;
+	job.type = REQUEST_JOB;
+	job.req = req;
+	job.client_eof = false;
+	job.waiter = &waiter;
+	queueJob(&job, true);
+
+	pthread_mutex_lock(&waiter.lock);
+	while (!waiter.done)
+		pthread_cond_wait(&waiter.done_cond, &waiter.lock);
+	pthread_mutex_unlock(&waiter.lock);
+	pthread_mutex_destroy(&waiter.lock);
+	pthread_cond_destroy(&waiter.done_cond);
+	return waiter.result;
+}
@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <string>
 #include <iostream>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
 #include "func_lib.h"
 #include "networking.h"
+#include "packet_log.h"
 #include "mysql_lib.h"
+#include "stats.h"
+#include "spans.h"
 
 #define SERVER_URL "tcp://127.0.0.1:3306"
 #define SERVER_USERNAME "root"
@@ -12,32 +18,195 @@
 
 using namespace std;
 
-pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 MySQLDatabaseDriver databaseDriver;
-DatabaseCommandInterface database(databaseDriver, SERVER_URL, SERVER_USERNAME,
-								SERVER_PASSWORD, SERVER_DATABASE);
+DatabaseConnectionPool databasePool;
+
+/*
+ * waitShutdown() - wait for SIGINT or SIGTERM, write what is still queued for the database and the packet log and exit
+ * exits with _exit: the workers, event loops and dispatchers are still running queries, the static
+ * destructors exit runs would delete the database connections under them
+ * signals: the signals, blocked in every thread
+ */
+static void waitShutdown(sigset_t *signals)
+{
+	int sig;
+
+	sigwait(signals, &sig);
+	printf("Shutting down (signal %d)\n", sig);
+	databasePool.close();
+	packet_log_flush();
+	fflush(stdout);
+	cout.flush();
+	_exit(0);
+}
+
+/*
+ * usage() - print the command line the server takes
+ * return -1, for main to return
+ */
+static int usage(void)
+{
+	printf("Error: Usage is ./<executable> [-e event_loops] [-w workers] [-q max_queued] [-d db_connections] "
+			"[-t notify_threads] [-n drop|disconnect|coalesce] [-N max_outbound] [-l off|acked|all] "
+			"[-s log_sample] [-T trace_file] [-S stats_port] [-r span_sample] [port]\n");
+	return -1;
+}
 
 int main(int argc, char *argv[])
 {
 	int port = 5354;
-	int master_fd;
-	pthread_t notifyThread, clientThread;
+	int event_loops = 0; /* 0: a thread per client */
+	int workers = 0; /* 0: requests are served by the thread reading them, one per database connection with -e */
+	int max_queued = 1024;
+	int db_connections = sysconf(_SC_NPROCESSORS_ONLN); /* queries of one request each in parallel */
+	enum queuePolicies queue_policy = QUEUE_COALESCE; /* for notifications to a client that falls behind */
+	int max_outbound = DEFAULT_QUEUE_LEN;
+	int notify_threads = 1; /* notifications fanned out by recipient over this many threads */
+	enum packetLogLevels log_level = PACKET_LOG_ALL;
+	int log_sample = 1; /* log one packet in every log_sample a thread sends or receives */
+	const char *trace_file = NULL; /* binary packet trace written instead of log.txt */
+	int stats_port = 0; /* 0: no admin socket for the metrics */
+	int span_sample = 0; /* trace the stages of one request in span_sample, dumped on the stats port; 0: none */
+	int master_fd, opt;
+	pthread_t clientThread, shutdownThread;
+	static sigset_t signals;
 	pthread_attr_t attr;
 	int create_thrd, slave_fd;
 	int ret;
 
-	switch (argc)
+	while ((opt = getopt(argc, argv, "e:w:q:d:t:n:N:l:s:T:S:r:")) != -1)
 	{
-	case 1:
+		switch (opt)
+		{
+		case 'e':
+			event_loops = atoi(optarg);
+			if (event_loops <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'q':
+			max_queued = atoi(optarg);
+			if (max_queued <= 0)
+			{
+				return usage();
+			}
 			break;
-	case 2:
-			port = stoi(argv[1]);
+		case 'd':
+			db_connections = atoi(optarg);
+			if (db_connections <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 't':
+			notify_threads = atoi(optarg);
+			if (notify_threads <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'n':
+			if (!strcmp(optarg, "drop"))
+				queue_policy = QUEUE_DROP_OLDEST;
+			else if (!strcmp(optarg, "disconnect"))
+				queue_policy = QUEUE_DISCONNECT;
+			else if (!strcmp(optarg, "coalesce"))
+				queue_policy = QUEUE_COALESCE;
+			else
+			{
+				return usage();
+			}
+			break;
+		case 'N':
+			max_outbound = atoi(optarg);
+			if (max_outbound <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'l':
+			if (!strcmp(optarg, "off"))
+				log_level = PACKET_LOG_OFF;
+			else if (!strcmp(optarg, "acked"))
+				log_level = PACKET_LOG_ACKED;
+			else if (!strcmp(optarg, "all"))
+				log_level = PACKET_LOG_ALL;
+			else
+			{
+				return usage();
+			}
+			break;
+		case 's':
+			log_sample = atoi(optarg);
+			if (log_sample <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'S':
+			stats_port = atoi(optarg);
+			if (stats_port <= 0)
+			{
+				return usage();
+			}
+			break;
+		case 'r':
+			span_sample = atoi(optarg);
+			if (span_sample < 0)
+			{
+				return usage();
+			}
+			break;
+		default:
+			return usage();
+		}
+	}
+	switch (argc - optind)
+	{
+	case 0:
+			break;
+	case 1:
+			port = stoi(argv[optind]);
 			break;
 	default:
-			printf("Error: Usage is ./<executable> [port]\n");
-			return -1;
+			return usage();
+	}
+	if (db_connections <= 0)
+		db_connections = 1;
+	if (event_loops > 0 && workers == 0)
+		workers = db_connections; /* the loops only read, a request blocks on the database and its ACK */
+	packet_log_config(log_level, log_sample);
+	if (trace_file != NULL && packet_log_trace(trace_file) < 0)
+		return -1;
+	/* blocked before any thread is created, so only waitShutdown takes them */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (databasePool.open(databaseDriver, SERVER_URL, SERVER_USERNAME, SERVER_PASSWORD,
+				SERVER_DATABASE, db_connections) < 0)
+	{
+		printf("Error (open): Database connection error\n");
+		return -1;
+	}
+	set_queue_policy(queue_policy, max_outbound);
+	set_ack_handler(statsAck);
+	spansConfig(span_sample);
+	if (stats_port > 0 && startStats(stats_port) < 0)
+	{
+		printf("Error (startStats): Stats socket creation error\n");
+		return -1;
 	}
 	master_fd = create_server_socket(port);
 	if (master_fd < 0)
@@ -47,10 +216,25 @@ int main(int argc, char *argv[])
 	}
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	ret = pthread_create(&notifyThread, &attr, (void * (*) (void *)) processNotification, NULL);
-	if (ret < 0)
+	ret = pthread_create(&shutdownThread, &attr, (void * (*) (void *)) waitShutdown, (void *) &signals);
+	if (ret != 0)
 	{
-		printf("Error (pthread_create): %s\n", strerror(errno));
+		printf("Error (pthread_create): %s\n", strerror(ret));
+		return -1;
+	}
+	if (startNotifications(notify_threads) < 0)
+	{
+		printf("Error (startNotifications): Notification thread creation error\n");
+		return -1;
+	}
+	if (workers > 0 && startWorkers(workers, max_queued) < 0)
+	{
+		printf("Error (startWorkers): Worker creation error\n");
+		return -1;
+	}
+	if (event_loops > 0 && startEventLoops(event_loops) < 0)
+	{
+		printf("Error (startEventLoops): Event loop creation error\n");
 		return -1;
 	}
 	while(1)
@@ -64,6 +248,13 @@ int main(int argc, char *argv[])
 			printf("Error (accept_socket)\n");
 			return -1;
 		}
+		if (event_loops > 0)
+		{
+			/* the event loops serve the client */
+			if (addClient(slave_fd) < 0)
+				destroy_socket(slave_fd);
+			continue;
+		}
 		/* Create thread for each client */
 		create_thrd = pthread_create(&clientThread, &attr, (void * (*) (void *)) handleClient, (void *)((long) slave_fd));
 		if (create_thrd < 0)
@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "networking.h"
+#include "spans.h"
+
+using namespace std;
+
+/*
+ * spanRecord - a finished span
+ * trace: sessionId << 32 | req_num of the request it belongs to
+ * name: string literal
+ * start_us, dur_us: steady clock, as the ts and dur of a trace event
+ * tid: thread that ran it
+ */
+struct spanRecord {
+	uint64_t trace;
+	const char *name;
+	uint64_t start_us;
+	uint64_t dur_us;
+	pid_t tid;
+};
+
+static atomic<unsigned int> spanSample(0);	/* trace one request in spanSample, 0 for none */
+static atomic<unsigned long> spanRequests;
+
+/* spans_lock guards the ring, only taken by threads of sampled requests and dumps */
+static pthread_mutex_t spans_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spanRecord spans[SPAN_RING];
+static uint64_t spans_written;
+
+/* the request the thread is serving, if it is sampled */
+static thread_local bool thread_sampled;
+static thread_local uint64_t thread_trace;
+static thread_local chrono::steady_clock::time_point thread_received;
+static thread_local pid_t thread_tid;
+
+static uint64_t steadyUs(chrono::steady_clock::time_point at)
+{
+	return chrono::duration_cast<chrono::microseconds>(at.time_since_epoch()).count();
+}
+
+static void recordSpan(const char *name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+{
+	struct spanRecord *span;
+
+	if (thread_tid == 0)
+		thread_tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&spans_lock);
+	span = &spans[spans_written++ % SPAN_RING];
+	span->trace = thread_trace;
+	span->name = name;
+	span->start_us = steadyUs(start);
+	span->dur_us = steadyUs(end) - span->start_us;
+	span->tid = thread_tid;
+	pthread_mutex_unlock(&spans_lock);
+	return;
+}
+
+/*
+ * spansConfig() - trace one request in every sample, 0 to trace none
+ */
+void spansConfig(unsigned int sample)
+{
+	spanSample.store(sample);
+	return;
+}
+
+/*
+ * spanRequestBegin() - start serving a request on this thread, traced if it is sampled
+ * req: the request
+ * received: when it was read, the time before now is recorded as its queue span
+ */
+void spanRequestBegin(struct packet &req, chrono::steady_clock::time_point received)
+{
+	unsigned int sample = spanSample.load(memory_order_relaxed);
+
+	thread_sampled = sample > 0 && spanRequests.fetch_add(1, memory_order_relaxed) % sample == 0;
+	if (!thread_sampled)
+		return;
+	thread_trace = ((uint64_t) req.sessionId << 32) | req.req_num;
+	thread_received = received;
+	recordSpan("queue", received, chrono::steady_clock::now());
+	return;
+}
+
+/*
+ * spanRequestEnd() - the request is served, record it as the span holding the spans of its stages
+ */
+void spanRequestEnd(struct packet &req)
+{
+	if (!thread_sampled)
+		return;
+	recordSpan((unsigned int) req.cmd_code < NOTIFY ? commandList[req.cmd_code] : "request", thread_received,
+			chrono::steady_clock::now());
+	thread_sampled = false;
+	return;
+}
+
+/*
+ * spanTrace() - the trace of the request this thread serves
+ * return true if it is sampled, with its id in trace
+ */
+bool spanTrace(uint64_t *trace)
+{
+	if (thread_sampled)
+		*trace = thread_trace;
+	return thread_sampled;
+}
+
+/*
+ * spanResume() - record the spans of this thread under a trace taken from spanTrace on another, until spanStop
+ */
+void spanResume(uint64_t trace)
+{
+	thread_sampled = true;
+	thread_trace = trace;
+	return;
+}
+
+void spanStop(void)
+{
+	thread_sampled = false;
+	return;
+}
+
+/*
+ * spanStart() - start of a span ended by spanEnd, read from the clock only for a sampled request
+ */
+chrono::steady_clock::time_point spanStart(void)
+{
+	return thread_sampled ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+}
+
+void spanEnd(const char *name, chrono::steady_clock::time_point start)
+{
+	if (thread_sampled)
+		recordSpan(name, start, chrono::steady_clock::now());
+	return;
+}
+
+spanScope::spanScope(const char *name) : name(name), start(spanStart())
+{
+}
+
+spanScope::~spanScope()
+{
+	spanEnd(name, start);
+}
+
+/*
+ * spansJson() - the spans kept, oldest first, as a Chrome trace event JSON object
+ */
+string spansJson(void)
+{
+	vector<struct spanRecord> kept;
+	uint64_t first, i;
+	char event[512];
+	string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	pthread_mutex_lock(&spans_lock);
+	first = spans_written > SPAN_RING ? spans_written - SPAN_RING : 0;
+	for (i = first; i < spans_written; i++)
+		kept.push_back(spans[i % SPAN_RING]);
+	pthread_mutex_unlock(&spans_lock);
+
+	for (i = 0; i < kept.size(); i++)
+	{
+		snprintf(event, sizeof(event), "%s\n{\"name\":\"%s\",\"cat\":\"walltalk\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"sessionId\":%u,\"req_num\":%u}}", i ? "," : "", kept[i].name,
+				(unsigned long long) kept[i].start_us, (unsigned long long) kept[i].dur_us, (int) getpid(), (int) kept[i].tid,
+				(unsigned int) (kept[i].trace >> 32), (unsigned int) kept[i].trace);
+		out += event;
+	}
+	out += "\n]}\n";
+	return out;
+}
@@ -0,0 +1,40 @@
+#ifndef SPANS_H_
+#define SPANS_H_
+
+#include <stdint.h>
+#include <string>
+#include <chrono>
+#include "structures.h"
+
+#define SPAN_RING 16384	/* spans kept for a dump, older ones are overwritten */
+
+/*
+spans time the stages of a sampled request on the thread serving it: the request, its parsing, session check,
+DatabaseCommandInterface calls, responses and notification wake-up; a notification round woken by a sampled
+request is traced under the request too. A trace is identified by sessionId and req_num of its request and
+the recent spans are dumped in the Chrome trace event format (chrome://tracing, Perfetto)
+*/
+
+/*
+ * spanScope - a span from its construction to its destruction, recorded if the thread serves a sampled request
+ */
+struct spanScope {
+	const char *name;
+	std::chrono::steady_clock::time_point start;
+
+	spanScope(const char *name);
+	~spanScope();
+};
+
+/* spans.cpp */
+void spansConfig(unsigned int sample);
+void spanRequestBegin(struct packet &req, std::chrono::steady_clock::time_point received);
+void spanRequestEnd(struct packet &req);
+bool spanTrace(uint64_t *trace);
+void spanResume(uint64_t trace);
+void spanStop(void);
+std::chrono::steady_clock::time_point spanStart(void);
+void spanEnd(const char *name, std::chrono::steady_clock::time_point start);
+std::string spansJson(void);
+
+#endif /* SPANS_H_ */
@@ -0,0 +1,313 @@
+#include <string>
+#include "func_lib.h"
+#include "stats.h"
+#include "spans.h"
+
+using namespace std;
+
+#define STATS_REQUEST_LEN 1024	/* bytes of a scrape request looked at, the rest is ignored */
+#define STATS_LE_MAX 25	/* histogram buckets go up to 2^25 us (33.5 s), then +Inf */
+
+static const char *dbMethodNames[DB_METHOD_COUNT] = { "hasValidSession", "login", "logout", "listUsers",
+		"postOnWall", "showWall", "refreshUsers" };
+static const char *dbSpanNames[DB_METHOD_COUNT] = { "db.hasValidSession", "db.login", "db.logout", "db.listUsers",
+		"db.postOnWall", "db.showWall", "db.refreshUsers" };
+
+static struct latencyHistogram requestLatency[STATS_COMMANDS];	/* read to last response written, NOTIFY queued to acknowledged */
+static struct latencyHistogram databaseLatency[DB_METHOD_COUNT];
+static struct latencyHistogram ackLatency[STATS_COMMANDS + 1];	/* by the command of the packet written, ACK last */
+static atomic<uint64_t> rejectedRequests;
+static atomic<uint64_t> notificationResults[3];	/* acknowledged, dropped by the queue policy, failed */
+
+/*
+ * bucketIndex() - histogram bucket of a latency
+ * us: latency in microseconds
+ */
+static inline unsigned int bucketIndex(uint64_t us)
+{
+	if (us > HISTOGRAM_MAX_US)
+		us = HISTOGRAM_MAX_US;
+	if (us < (1U << HISTOGRAM_SUB_BITS))
+		return us;
+	unsigned int exponent = 63 - __builtin_clzll(us);
+	return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+			+ ((us >> (exponent - HISTOGRAM_SUB_BITS)) & ((1U << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/*
+ * bucketUpper() - smallest latency in microseconds above a histogram bucket
+ */
+static uint64_t bucketUpper(unsigned int index)
+{
+	if (index < (1U << HISTOGRAM_SUB_BITS))
+		return index + 1;
+	unsigned int exponent = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = index & ((1U << HISTOGRAM_SUB_BITS) - 1);
+	return (((1ULL << HISTOGRAM_SUB_BITS) + sub + 1) << (exponent - HISTOGRAM_SUB_BITS));
+}
+
+static void observe(struct latencyHistogram &histogram, uint64_t us)
+{
+	histogram.buckets[bucketIndex(us)].fetch_add(1, memory_order_relaxed);
+	histogram.sum_us.fetch_add(us, memory_order_relaxed);
+}
+
+static uint64_t elapsedUs(chrono::steady_clock::time_point since)
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count();
+}
+
+/*
+ * statsRequest() - a request was served
+ * cmd: its command
+ * received: when it was read from the client
+ */
+void statsRequest(enum commands cmd, chrono::steady_clock::time_point received)
+{
+	if ((unsigned int) cmd < STATS_COMMANDS)
+		observe(requestLatency[cmd], elapsedUs(received));
+	return;
+}
+
+/*
+ * statsRejected() - a request was answered with an invalid session
+ */
+void statsRejected(void)
+{
+	rejectedRequests.fetch_add(1, memory_order_relaxed);
+	return;
+}
+
+/*
+ * statsNotification() - the fate of a queued notification was reported
+ * latency: from queueing it to the report
+ * result: 0(acknowledged) -4(dropped by the queue policy) other(write failed)
+ */
+void statsNotification(chrono::steady_clock::duration latency, int result)
+{
+	if (result == 0)
+	{
+		observe(requestLatency[NOTIFY], chrono::duration_cast<chrono::microseconds>(latency).count());
+		notificationResults[0].fetch_add(1, memory_order_relaxed);
+	}
+	else
+		notificationResults[result == -4 ? 1 : 2].fetch_add(1, memory_order_relaxed);
+	return;
+}
+
+/*
+ * statsDatabase() - a DatabaseCommandInterface method returned
+ * method: the method
+ * start: when it was called
+ */
+void statsDatabase(enum dbMethods method, chrono::steady_clock::time_point start)
+{
+	observe(databaseLatency[method], elapsedUs(start));
+	return;
+}
+
+statsTimer::~statsTimer()
+{
+	statsDatabase(method, start);
+	spanEnd(dbSpanNames[method], start);
+}
+
+/*
+ * statsAck() - write_socket received the ACK of a packet, see set_ack_handler
+ */
+void statsAck(struct packet &pkt, double response_ms)
+{
+	observe(ackLatency[min((unsigned int) pkt.cmd_code, (unsigned int) STATS_COMMANDS)], response_ms * 1000);
+	return;
+}
+
+/*
+ * writeHistogram() - append a histogram in the Prometheus text format, and its quantiles as gauges
+ * out: for the histogram lines
+ * quantilesOut: for the gauges, a family of their own (name_quantile) written after the histograms
+ * name: metric name
+ * labels: label of the histogram, as in name{labels}
+ */
+static void writeHistogram(string &out, string &quantilesOut, const char *name, string labels,
+		struct latencyHistogram &histogram)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS], count = 0, cumulative = 0;
+	const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	char line[256];
+	unsigned int i = 0, le, q;
+
+	/* counters keep moving while they are read, the buckets written add up to the count written */
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		counts[i] = histogram.buckets[i].load(memory_order_relaxed);
+		count += counts[i];
+	}
+	i = 0;
+	for (le = 0; le <= STATS_LE_MAX; le++)
+	{
+		for (; i < HISTOGRAM_BUCKETS && bucketUpper(i) <= (1ULL << le); i++)
+			cumulative += counts[i];
+		snprintf(line, sizeof(line), "%s_bucket{%s,le=\"%.6f\"} %llu\n", name, labels.c_str(), (1ULL << le) / 1e6,
+				(unsigned long long) cumulative);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.6f\n%s_count{%s} %llu\n", name,
+			labels.c_str(), (unsigned long long) count, name, labels.c_str(),
+			histogram.sum_us.load(memory_order_relaxed) / 1e6, name, labels.c_str(), (unsigned long long) count);
+	out += line;
+
+	/* nearest rank, reported as the top of its bucket */
+	for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && count > 0; q++)
+	{
+		uint64_t rank = (uint64_t) (quantiles[q] * count + 0.999999);
+		for (i = 0, cumulative = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+		{
+			cumulative += counts[i];
+			if (cumulative >= rank)
+				break;
+		}
+		snprintf(line, sizeof(line), "%s_quantile{%s,quantile=\"%g\"} %.6f\n", name, labels.c_str(), quantiles[q],
+				(bucketUpper(i) - 1) / 1e6);
+		quantilesOut += line;
+	}
+	return;
+}
+
+static void writeHelp(string &out, string name, const char *help, const char *type)
+{
+	out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+	return;
+}
+
+/*
+ * writeFamily() - append the histograms of a metric, one per label, then the gauges of their quantiles
+ * labels: label values, the name of each label is label
+ */
+static void writeFamily(string &out, const char *name, const char *help, const char *label, const char **labels,
+		struct latencyHistogram *histograms, unsigned int count)
+{
+	string quantiles;
+	unsigned int i;
+
+	writeHelp(out, name, help, "histogram");
+	for (i = 0; i < count; i++)
+		writeHistogram(out, quantiles, name, string(label) + "=\"" + labels[i] + "\"", histograms[i]);
+	writeHelp(out, string(name) + "_quantile", "Quantiles of the histogram, to the top of their bucket.", "gauge");
+	out += quantiles;
+	return;
+}
+
+/*
+ * formatStats() - every metric in the Prometheus text exposition format (version 0.0.4)
+ */
+static string formatStats(void)
+{
+	string out;
+
+	writeFamily(out, "walltalk_request_seconds",
+			"Time from reading a request to writing its last response (NOTIFY: from queueing to the ACK).", "command",
+			(const char **) commandList, requestLatency, STATS_COMMANDS);
+	writeFamily(out, "walltalk_database_seconds", "Time spent in a DatabaseCommandInterface method.", "method",
+			dbMethodNames, databaseLatency, DB_METHOD_COUNT);
+	writeFamily(out, "walltalk_ack_seconds", "Time from writing a packet to receiving its ACK, for writes waiting for it.",
+			"command", (const char **) commandList, ackLatency, STATS_COMMANDS + 1);
+
+	writeHelp(out, "walltalk_requests_rejected_total", "Requests answered with an invalid session.", "counter");
+	out += "walltalk_requests_rejected_total " + to_string(rejectedRequests.load()) + "\n";
+	writeHelp(out, "walltalk_notifications_total", "Queued notifications by fate.", "counter");
+	out += "walltalk_notifications_total{result=\"acknowledged\"} " + to_string(notificationResults[0].load()) + "\n";
+	out += "walltalk_notifications_total{result=\"dropped\"} " + to_string(notificationResults[1].load()) + "\n";
+	out += "walltalk_notifications_total{result=\"failed\"} " + to_string(notificationResults[2].load()) + "\n";
+	return out;
+}
+
+/*
+ * serveStats() - answer every connection to the admin socket with the metrics, as an HTTP/1.0 response,
+ * or the recent spans as Chrome trace JSON for GET /spans
+ * stats_fd: listening admin socket
+ */
+static void serveStats(long stats_fd)
+{
+	char request[STATS_REQUEST_LEN];
+	struct timeval timeout = { TIMEOUT_SEC, 0 };
+	string response;
+	const char *type;
+	int fd;
+	ssize_t sent, len;
+
+	while (1)
+	{
+		fd = accept(stats_fd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno != EINTR)
+				printf("Error (accept): stats connection: %s\n", strerror(errno));
+			continue;
+		}
+		/* read the request so closing does not reset the connection, anything but GET /spans gets the metrics */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		len = recv(fd, request, sizeof(request), 0);
+		if (len > 0 && string(request, len).compare(0, strlen("GET /spans"), "GET /spans") == 0)
+		{
+			response = spansJson();
+			type = "application/json";
+		}
+		else
+		{
+			response = formatStats();
+			type = "text/plain; version=0.0.4";
+		}
+		response = "HTTP/1.0 200 OK\r\nContent-Type: " + string(type) + "\r\nContent-Length: "
+				+ to_string(response.length()) + "\r\nConnection: close\r\n\r\n" + response;
+		for (size_t done = 0; done < response.length(); done += sent)
+		{
+			sent = send(fd, response.data() + done, response.length() - done, MSG_NOSIGNAL);
+			if (sent <= 0)
+				break;
+		}
+		close(fd);
+	}
+	return;
+}
+
+/*
+ * startStats() - serve the metrics on 127.0.0.1:port to a Prometheus scrape or curl
+ * port: admin port, only reachable from the host
+ * return 0(success) -1(error)
+ */
+int startStats(int port)
+{
+	struct sockaddr_in addr;
+	pthread_t statsThread;
+	pthread_attr_t attr;
+	int stats_fd, enable = 1, ret;
+
+	stats_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (stats_fd < 0)
+	{
+		printf("Error (socket): stats socket: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(stats_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(stats_fd, LISTEN_QUEUE_LENGTH) < 0)
+	{
+		printf("Error (bind): stats port %d: %s\n", port, strerror(errno));
+		close(stats_fd);
+		return -1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&statsThread, &attr, (void * (*) (void *)) serveStats, (void *) (long) stats_fd);
+	if (ret != 0)
+	{
+		printf("Error (pthread_create): %s\n", strerror(ret));
+		close(stats_fd);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include "structures.h"
+
+#define HISTOGRAM_SUB_BITS 3	/* 8 buckets per power of two, values within 12.5% */
+#define HISTOGRAM_MAX_US ((1ULL << 36) - 1)	/* larger latencies count as this */
+#define HISTOGRAM_BUCKETS ((36 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define STATS_COMMANDS (NOTIFY + 1)	/* commands a request or notification latency is kept for */
+
+/*
+ * dbMethods - DatabaseCommandInterface methods the time in the database is kept for
+ */
+enum dbMethods {
+	DB_HAS_VALID_SESSION,
+	DB_LOGIN,
+	DB_LOGOUT,
+	DB_LIST_USERS,
+	DB_POST_ON_WALL,
+	DB_SHOW_WALL,
+	DB_REFRESH_USERS,
+	DB_METHOD_COUNT
+};
+
+/*
+ * latencyHistogram - latencies in microseconds in log-linear buckets, updated without locks
+ * buckets: values below 2^HISTOGRAM_SUB_BITS one each, then 2^HISTOGRAM_SUB_BITS buckets per power of two
+ * sum_us: sum of the values, for the mean
+ */
+struct latencyHistogram {
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> sum_us;
+};
+
+/*
+ * statsTimer - time spent in a DatabaseCommandInterface method, from its construction to its destruction
+ */
+struct statsTimer {
+	enum dbMethods method;
+	std::chrono::steady_clock::time_point start;
+
+	statsTimer(enum dbMethods method) : method(method), start(std::chrono::steady_clock::now()) {}
+	~statsTimer();
+};
+
+/* stats.cpp */
+void statsRequest(enum commands cmd, std::chrono::steady_clock::time_point received);
+void statsRejected(void);
+void statsNotification(std::chrono::steady_clock::duration latency, int result);
+void statsDatabase(enum dbMethods method, std::chrono::steady_clock::time_point start);
+void statsAck(struct packet &pkt, double response_ms);
+int startStats(int port);
+
+#endif /* STATS_H_ */